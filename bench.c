@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "block.h"
+#include "cache.h"
+#include "mdadm.h"
+#include "util.h"
+
+#define BENCH_ARGUMENTS "hn:s:p:t:f:c"
+#define USAGE                                               \
+  "USAGE: bench [-h] [-n samples] [-s seed] [-p policy] [-t threads] [-f filter] [-c]\n" \
+  "\n"                                                      \
+  "where:\n"                                                \
+  "    -h - help mode (display this message)\n"             \
+  "    -n - timed samples per benchmark (default 100000)\n" \
+  "    -s - random seed; the same seed gives the same addresses (default 1)\n" \
+  "    -p - cache eviction policy: mru, lru (default), clock, 2q or arc\n" \
+  "    -t - most threads for the scaling benchmarks (default 8)\n" \
+  "    -f - only run benchmarks whose name contains this string\n" \
+  "    -c - print comma-separated values instead of a table\n" \
+  "\n"                                                      \
+  "Times are in nanoseconds per call. Calls that take a few nanoseconds are\n" \
+  "timed in batches, and each sample is its batch's mean.\n" \
+  "\n"
+
+#define NUM_KEYS   (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define NUM_ADDRS  4096
+#define MAX_LEN    1024
+#define MAX_THREADS 64
+
+/* Calls per sample for the cache benchmarks, which are too quick to time one
+ * by one. */
+#define CACHE_BATCH 16
+
+/* One call of a benchmark; |i| counts the calls. */
+typedef void (*bench_op_t)(void *ctx, uint32_t i);
+
+/* What the operations below work on: a set of cache keys or of addresses,
+ * picked before timing starts, and a buffer. */
+typedef struct {
+  const uint16_t *keys;
+  uint32_t num_keys;
+  const uint32_t *addrs;     /* NUM_ADDRS of them */
+  uint32_t first_addr;       /* index of the address the first call uses */
+  uint32_t len;
+  uint8_t buf[MAX_LEN];
+  int failures;
+} bench_ctx_t;
+
+static int num_samples = 100000;
+static cache_policy_t policy = CACHE_POLICY_LRU;
+static const char *filter = NULL;
+static bool csv = false;
+static uint64_t timer_overhead;
+
+/* A random order of every cache key. With a cache of n entries, the first n
+ * are resident and the rest are not. */
+static uint16_t key_order[NUM_KEYS];
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The cost of reading the clock, which every sample takes off. */
+static uint64_t measure_timer_overhead(void) {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 10000; ++i) {
+    uint64_t start = now_ns(), d = now_ns() - start;
+    if (d < best)
+      best = d;
+  }
+  return best;
+}
+
+static bool wanted(const char *name) {
+  return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/* Uniform in [0, n). */
+static uint32_t rand_below(uint32_t n) {
+  return rand_u64() % n;
+}
+
+static void shuffle_keys(void) {
+  for (int i = 0; i < NUM_KEYS; ++i)
+    key_order[i] = i;
+  for (int i = NUM_KEYS - 1; i > 0; --i) {
+    uint32_t j = rand_below(i + 1);
+    uint16_t t = key_order[i];
+    key_order[i] = key_order[j];
+    key_order[j] = t;
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_header(void) {
+  if (csv)
+    printf("benchmark,ops,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,mops\n");
+  else
+    printf("%-32s %9s %9s %9s %9s %9s %9s %9s %8s\n", "benchmark", "ops", "mean", "p50",
+           "p90", "p99", "p99.9", "max", "Mops/s");
+}
+
+/* Sorts |samples| and prints their percentiles, with the throughput of
+ * |ops| calls over |wall_ns|. */
+static void report(const char *name, double *samples, int n, uint64_t ops, uint64_t wall_ns) {
+  double sum = 0;
+  for (int i = 0; i < n; ++i)
+    sum += samples[i];
+  qsort(samples, n, sizeof(*samples), compare_doubles);
+#define PCT(p) samples[(int)((n - 1) * (p))]
+  double mops = wall_ns ? ops * 1e3 / wall_ns : 0;
+  if (csv)
+    printf("%s,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f\n", name, (unsigned long long)ops,
+           sum / n, PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), samples[n - 1], mops);
+  else
+    printf("%-32s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.3f\n", name,
+           (unsigned long long)ops, sum / n, PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999),
+           samples[n - 1], mops);
+#undef PCT
+  fflush(stdout);
+}
+
+/* Times |n| samples of |batch| calls each into |samples|, after a tenth as
+ * many untimed calls to warm up. Returns the wall time of the timed calls. */
+static uint64_t run_samples(bench_op_t op, void *ctx, int batch, int n, double *samples) {
+  uint32_t i = 0;
+  for (int w = 0; w < n / 10 * batch; ++w)
+    op(ctx, i++);
+  uint64_t started = now_ns();
+  for (int s = 0; s < n; ++s) {
+    uint64_t start = now_ns();
+    for (int b = 0; b < batch; ++b)
+      op(ctx, i++);
+    uint64_t d = now_ns() - start;
+    d = d > timer_overhead ? d - timer_overhead : 0;
+    samples[s] = (double)d / batch;
+  }
+  return now_ns() - started;
+}
+
+/* Runs |op| in the calling thread and reports it as |name|. */
+static void bench(const char *name, bench_op_t op, bench_ctx_t *ctx, int batch) {
+  double *samples = malloc(sizeof(*samples) * num_samples);
+  if (samples == NULL)
+    err(1, "Cannot allocate samples");
+  ctx->failures = 0;
+  uint64_t wall = run_samples(op, ctx, batch, num_samples, samples);
+  report(name, samples, num_samples, (uint64_t)num_samples * batch, wall);
+  if (ctx->failures)
+    fprintf(stderr, "bench: %s: %d calls failed\n", name, ctx->failures);
+  free(samples);
+}
+
+static void op_cache_lookup(void *arg, uint32_t i) {
+  bench_ctx_t *ctx = arg;
+  uint16_t key = ctx->keys[i % ctx->num_keys];
+  cache_lookup(key_disk(key), key_block(key), ctx->buf);
+}
+
+/* Inserts keys in |key_order|, round and round, from just past the resident
+ * ones. Each key was inserted too long ago to still be cached under a policy
+ * that evicts by recency, so each call evicts. */
+static void op_cache_insert(void *arg, uint32_t i) {
+  bench_ctx_t *ctx = arg;
+  uint16_t key = key_order[(ctx->num_keys + i) % NUM_KEYS];
+  if (cache_insert(key_disk(key), key_block(key), ctx->buf) != 1)
+    ctx->failures++;
+}
+
+static void op_mdadm_read(void *arg, uint32_t i) {
+  bench_ctx_t *ctx = arg;
+  uint32_t addr = ctx->addrs[(ctx->first_addr + i) % NUM_ADDRS];
+  if (mdadm_read(addr, ctx->len, ctx->buf) != (int)ctx->len)
+    ctx->failures++;
+}
+
+static void op_mdadm_write(void *arg, uint32_t i) {
+  bench_ctx_t *ctx = arg;
+  uint32_t addr = ctx->addrs[(ctx->first_addr + i) % NUM_ADDRS];
+  if (mdadm_write(addr, ctx->len, ctx->buf) != (int)ctx->len)
+    ctx->failures++;
+}
+
+/* Creates a cache of |size| entries holding the first |size| keys of
+ * |key_order|. */
+static void fill_cache(int size, int shards) {
+  uint8_t block[JBOD_BLOCK_SIZE] = { 0 };
+  if (cache_create_sharded(size, policy, shards) != 1)
+    errx(1, "Cannot create a cache of %d entries", size);
+  for (int i = 0; i < size; ++i)
+    cache_insert(key_disk(key_order[i]), key_block(key_order[i]), block);
+}
+
+static void bench_cache(void) {
+  static const int sizes[] = { 16, 256, 1024, 2048 };
+  bench_ctx_t ctx = { 0 };
+  char name[64];
+
+  for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+    int size = sizes[n];
+    fill_cache(size, 1);
+    ctx.keys = key_order;
+    ctx.num_keys = size;
+    snprintf(name, sizeof(name), "cache_lookup_hit/%d", size);
+    if (wanted(name))
+      bench(name, op_cache_lookup, &ctx, CACHE_BATCH);
+    ctx.keys = key_order + size;
+    ctx.num_keys = NUM_KEYS - size;
+    snprintf(name, sizeof(name), "cache_lookup_miss/%d", size);
+    if (wanted(name))
+      bench(name, op_cache_lookup, &ctx, CACHE_BATCH);
+    ctx.num_keys = size;
+    snprintf(name, sizeof(name), "cache_insert_evict/%d", size);
+    if (wanted(name))
+      bench(name, op_cache_insert, &ctx, CACHE_BATCH);
+    cache_destroy();
+  }
+}
+
+/* Fills |addrs| with random addresses of |len|-byte I/Os that stay on one
+ * disk: block-aligned if |aligned|, and otherwise starting anywhere but a
+ * block boundary. */
+static void pick_addrs(uint32_t *addrs, uint32_t len, bool aligned) {
+  uint32_t blocks = (len + JBOD_BLOCK_SIZE - 1) / JBOD_BLOCK_SIZE + !aligned;
+  for (int i = 0; i < NUM_ADDRS; ++i) {
+    uint32_t disk = rand_below(JBOD_NUM_DISKS);
+    uint32_t block = rand_below(JBOD_NUM_BLOCKS_PER_DISK - blocks + 1);
+    uint32_t offset = aligned ? 0 : 1 + rand_below(JBOD_BLOCK_SIZE - 1);
+    addrs[i] = disk * JBOD_DISK_SIZE + block * JBOD_BLOCK_SIZE + offset;
+  }
+}
+
+/* Fills |addrs| with |len|-byte I/Os split evenly across a disk boundary. */
+static void pick_cross_disk_addrs(uint32_t *addrs, uint32_t len) {
+  for (int i = 0; i < NUM_ADDRS; ++i)
+    addrs[i] = (1 + rand_below(JBOD_NUM_DISKS - 1)) * JBOD_DISK_SIZE - len / 2;
+}
+
+static void bench_mdadm(void) {
+  static const uint32_t lens[] = { 1, 16, 64, 256, 1024 };
+  static uint32_t addrs[NUM_ADDRS];
+  bench_ctx_t ctx = { .addrs = addrs };
+  char name[64];
+
+  for (int write = 0; write < 2; ++write) {
+    for (int aligned = 1; aligned >= 0; --aligned) {
+      for (size_t n = 0; n < sizeof(lens) / sizeof(lens[0]); ++n) {
+        ctx.len = lens[n];
+        snprintf(name, sizeof(name), "mdadm_%s_%s/%u", write ? "write" : "read",
+                 aligned ? "aligned" : "unaligned", ctx.len);
+        if (!wanted(name))
+          continue;
+        pick_addrs(addrs, ctx.len, aligned);
+        bench(name, write ? op_mdadm_write : op_mdadm_read, &ctx, 1);
+      }
+    }
+  }
+  for (size_t n = 1; n < sizeof(lens) / sizeof(lens[0]); ++n) {
+    ctx.len = lens[n];
+    snprintf(name, sizeof(name), "mdadm_read_cross_disk/%u", ctx.len);
+    if (!wanted(name))
+      continue;
+    pick_cross_disk_addrs(addrs, ctx.len);
+    bench(name, op_mdadm_read, &ctx, 1);
+  }
+}
+
+/* One thread of a scaling benchmark, with a context of its own. */
+typedef struct {
+  bench_op_t op;
+  bench_ctx_t ctx;
+  int batch;
+  int n;
+  double *samples;
+  pthread_barrier_t *start;
+  uint64_t started, finished; /* when its timed calls began and ended */
+} bench_thread_t;
+
+static void *bench_worker(void *arg) {
+  bench_thread_t *t = arg;
+  pthread_barrier_wait(t->start);
+  uint64_t wall = run_samples(t->op, &t->ctx, t->batch, t->n, t->samples);
+  t->finished = now_ns();
+  t->started = t->finished - wall;
+  return NULL;
+}
+
+/* Runs |op| on 1, 2, 4, ... up to |max_threads| threads at once, sharing the
+ * samples between them, and reports each run's merged percentiles and total
+ * throughput over the span from the first thread's timed calls starting to
+ * the last one's ending. */
+static void bench_scaling(const char *prefix, bench_op_t op, const bench_ctx_t *ctx, int batch,
+                          int max_threads) {
+  bench_thread_t threads[MAX_THREADS];
+  pthread_t ids[MAX_THREADS];
+  char name[64];
+  double *samples = malloc(sizeof(*samples) * num_samples);
+  if (samples == NULL)
+    err(1, "Cannot allocate samples");
+
+  for (int nt = 1; nt <= max_threads; nt *= 2) {
+    snprintf(name, sizeof(name), "%s/%d", prefix, nt);
+    int per_thread = num_samples / nt;
+    if (!wanted(name) || per_thread == 0)
+      continue;
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nt + 1);
+    for (int i = 0; i < nt; ++i) {
+      threads[i] = (bench_thread_t){ op, *ctx, batch, per_thread, samples + i * per_thread,
+                                     &start, 0, 0 };
+      /* Threads start at different places, so they do not march in step. */
+      threads[i].ctx.keys = ctx->keys ? ctx->keys + i * ctx->num_keys / nt : NULL;
+      threads[i].ctx.num_keys = ctx->num_keys - i * ctx->num_keys / nt;
+      threads[i].ctx.first_addr = ctx->first_addr + i * NUM_ADDRS / nt;
+      if (pthread_create(&ids[i], NULL, bench_worker, &threads[i]) != 0)
+        err(1, "Cannot start a benchmark thread");
+    }
+    pthread_barrier_wait(&start);
+    uint64_t started = UINT64_MAX, finished = 0;
+    int failures = 0;
+    for (int i = 0; i < nt; ++i) {
+      pthread_join(ids[i], NULL);
+      failures += threads[i].ctx.failures;
+      if (threads[i].started < started)
+        started = threads[i].started;
+      if (threads[i].finished > finished)
+        finished = threads[i].finished;
+    }
+    uint64_t wall = finished - started;
+    pthread_barrier_destroy(&start);
+    report(name, samples, per_thread * nt, (uint64_t)per_thread * nt * batch, wall);
+    if (failures)
+      fprintf(stderr, "bench: %s: %d calls failed\n", name, failures);
+  }
+  free(samples);
+}
+
+static void bench_threads(int max_threads) {
+  static uint32_t addrs[NUM_ADDRS];
+  bench_ctx_t ctx = { .keys = key_order, .num_keys = 1024 };
+
+  /* A quarter of the device is cached, so reads mix hits and device reads. */
+  fill_cache(1024, 8);
+  bench_scaling("threads_cache_lookup", op_cache_lookup, &ctx, CACHE_BATCH, max_threads);
+  ctx = (bench_ctx_t){ .addrs = addrs, .len = JBOD_BLOCK_SIZE };
+  pick_addrs(addrs, ctx.len, true);
+  bench_scaling("threads_mdadm_read", op_mdadm_read, &ctx, 1, max_threads);
+  cache_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+  uint64_t seed = 1;
+  int max_threads = 8;
+
+  while ((ch = getopt(argc, argv, BENCH_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'n':
+        num_samples = atoi(optarg);
+        if (num_samples < 1)
+          errx(1, "Invalid number of samples (%s), aborting.", optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'p':
+        if (cache_policy_parse(optarg, &policy) != 1)
+          errx(1, "Unknown cache policy (%s), aborting.", optarg);
+        break;
+      case 't':
+        max_threads = atoi(optarg);
+        if (max_threads < 1 || max_threads > MAX_THREADS)
+          errx(1, "Invalid number of threads (%s), aborting.", optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'c':
+        csv = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  rand_seed(seed);
+  shuffle_keys();
+  timer_overhead = measure_timer_overhead();
+  if (!csv)
+    printf("# samples %d, seed %llu, policy %s, kernels %s, timer overhead %llu ns\n",
+           num_samples, (unsigned long long)seed, cache_policy_name(policy), block_kernels(),
+           (unsigned long long)timer_overhead);
+  print_header();
+
+  bench_cache();
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "Cannot mount the device");
+  bench_mdadm();
+  bench_threads(max_threads);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  return 0;
+}
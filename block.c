@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "block.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_HAVE_AVX2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLOCK_HAVE_NEON 1
+#endif
+
+_Static_assert(JBOD_BLOCK_SIZE % 64 == 0, "the kernels work in 64-byte steps");
+
+static void generic_copy(uint8_t *dst, const uint8_t *src) {
+    memcpy(dst, src, JBOD_BLOCK_SIZE);
+}
+
+static void generic_fill(uint8_t *dst, uint8_t c, size_t len) {
+    memset(dst, c, len);
+}
+
+static bool generic_equal(const uint8_t *a, const uint8_t *b) {
+    return memcmp(a, b, JBOD_BLOCK_SIZE) == 0;
+}
+
+#ifdef BLOCK_HAVE_AVX2
+/* Compiled for AVX2 on their own, and only called once the CPU is known to
+ * have it, so the rest of the build does not depend on -mavx2. */
+__attribute__((target("avx2")))
+static void avx2_copy(uint8_t *dst, const uint8_t *src) {
+    for (int i = 0; i < JBOD_BLOCK_SIZE; i += 64) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), x);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), y);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_fill(uint8_t *dst, uint8_t c, size_t len) {
+    __m256i v = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    memset(dst + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool avx2_equal(const uint8_t *a, const uint8_t *b) {
+    __m256i diff = _mm256_setzero_si256();
+    for (int i = 0; i < JBOD_BLOCK_SIZE; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(x, y));
+    }
+    return _mm256_testz_si256(diff, diff);
+}
+#endif
+
+#ifdef BLOCK_HAVE_NEON
+/* NEON is part of the AArch64 baseline, so it needs no runtime check. */
+static void neon_copy(uint8_t *dst, const uint8_t *src) {
+    for (int i = 0; i < JBOD_BLOCK_SIZE; i += 64) {
+        uint8x16x4_t x = vld1q_u8_x4(src + i);
+        vst1q_u8_x4(dst + i, x);
+    }
+}
+
+static void neon_fill(uint8_t *dst, uint8_t c, size_t len) {
+    uint8x16_t v = vdupq_n_u8(c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, v);
+    }
+    memset(dst + i, c, len - i);
+}
+
+static bool neon_equal(const uint8_t *a, const uint8_t *b) {
+    uint8x16_t diff = vdupq_n_u8(0);
+    for (int i = 0; i < JBOD_BLOCK_SIZE; i += 16) {
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+    }
+    return vmaxvq_u8(diff) == 0;
+}
+#endif
+
+static void (*copy_kernel)(uint8_t *, const uint8_t *) = generic_copy;
+static void (*fill_kernel)(uint8_t *, uint8_t, size_t) = generic_fill;
+static bool (*equal_kernel)(const uint8_t *, const uint8_t *) = generic_equal;
+static const char *kernels_name = "generic";
+
+__attribute__((constructor))
+static void block_select_kernels(void) {
+#ifdef BLOCK_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        copy_kernel = avx2_copy;
+        fill_kernel = avx2_fill;
+        equal_kernel = avx2_equal;
+        kernels_name = "avx2";
+    }
+#elif defined(BLOCK_HAVE_NEON)
+    copy_kernel = neon_copy;
+    fill_kernel = neon_fill;
+    equal_kernel = neon_equal;
+    kernels_name = "neon";
+#endif
+}
+
+void block_copy(uint8_t *dst, const uint8_t *src) {
+    copy_kernel(dst, src);
+}
+
+void block_fill(uint8_t *dst, uint8_t c, size_t len) {
+    fill_kernel(dst, c, len);
+}
+
+bool block_equal(const uint8_t *a, const uint8_t *b) {
+    return equal_kernel(a, b);
+}
+
+const char *block_kernels(void) {
+    return kernels_name;
+}
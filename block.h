@@ -0,0 +1,140 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* The JBOD geometry is all powers of two, so device blocks and cache keys
+ * split with shifts and masks. */
+#define JBOD_BLOCK_SHIFT      __builtin_ctz(JBOD_BLOCK_SIZE)
+#define JBOD_KEY_BLOCK_SHIFT  __builtin_ctz(JBOD_NUM_BLOCKS_PER_DISK)
+
+_Static_assert((JBOD_BLOCK_SIZE & (JBOD_BLOCK_SIZE - 1)) == 0, "block size must be a power of two");
+_Static_assert((JBOD_NUM_BLOCKS_PER_DISK & (JBOD_NUM_BLOCKS_PER_DISK - 1)) == 0,
+               "blocks per disk must be a power of two");
+_Static_assert(JBOD_DISK_SIZE == JBOD_BLOCK_SIZE * JBOD_NUM_BLOCKS_PER_DISK,
+               "a disk must be a whole number of blocks");
+
+/* Offset of |addr| within its block. */
+static inline uint32_t addr_offset(uint32_t addr) {
+  return addr & (JBOD_BLOCK_SIZE - 1);
+}
+
+/* A dense index over every block of the device, and back. */
+static inline uint32_t block_key(uint32_t disk_num, uint32_t block_num) {
+  return (disk_num << JBOD_KEY_BLOCK_SHIFT) | block_num;
+}
+
+static inline uint32_t key_disk(uint32_t key) {
+  return key >> JBOD_KEY_BLOCK_SHIFT;
+}
+
+static inline uint32_t key_block(uint32_t key) {
+  return key & (JBOD_NUM_BLOCKS_PER_DISK - 1);
+}
+
+/* The shape of a volume: how its linear addresses map onto disks and blocks.
+ * In the linear layout |addr| / |disk_size| picks the disk. In the striped
+ * layout consecutive units of |stripe_blocks| blocks rotate across the disks,
+ * so unit u is on disk u % |num_disks|, at row u / |num_disks|. Power-of-two
+ * sizes, the common case, split addresses with shifts and masks; any other
+ * size divides. */
+typedef struct {
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint32_t stripe_blocks;  /* 0 for the linear layout */
+  uint32_t disk_size;      /* bytes */
+  uint64_t size;           /* bytes, over all disks */
+  int disk_shift;          /* log2(disk_size), or -1 if it is not a power of two */
+  int stripe_shift;        /* log2(stripe_blocks), or -1 */
+  int disks_shift;         /* log2(num_disks), or -1 */
+} block_geometry_t;
+
+static inline int log2_exact(uint32_t n) {
+  return n && (n & (n - 1)) == 0 ? __builtin_ctz(n) : -1;
+}
+
+/* Fills |g| in for |num_disks| disks of |blocks_per_disk| blocks, striped in
+ * units of |stripe_blocks| blocks, or laid out linearly if it is 0. */
+static inline void block_geometry_init(block_geometry_t *g, uint32_t num_disks,
+                                       uint32_t blocks_per_disk, uint32_t stripe_blocks) {
+  g->num_disks = num_disks;
+  g->blocks_per_disk = blocks_per_disk;
+  g->stripe_blocks = stripe_blocks;
+  g->disk_size = blocks_per_disk * JBOD_BLOCK_SIZE;
+  g->size = (uint64_t)num_disks * g->disk_size;
+  g->disk_shift = log2_exact(g->disk_size);
+  g->stripe_shift = log2_exact(stripe_blocks);
+  g->disks_shift = log2_exact(num_disks);
+}
+
+/* Splits |addr| into its disk and its block within that disk. */
+static inline void addr_locate(const block_geometry_t *g, uint32_t addr, uint32_t *disk_num,
+                               uint32_t *block_num) {
+  if (g->stripe_blocks == 0) {
+    if (g->disk_shift >= 0) {
+      *disk_num = addr >> g->disk_shift;
+      *block_num = (addr & (g->disk_size - 1)) >> JBOD_BLOCK_SHIFT;
+    } else {
+      *disk_num = addr / g->disk_size;
+      *block_num = addr % g->disk_size >> JBOD_BLOCK_SHIFT;
+    }
+    return;
+  }
+
+  uint32_t block = addr >> JBOD_BLOCK_SHIFT, unit, in_unit, row;
+  if (g->stripe_shift >= 0) {
+    unit = block >> g->stripe_shift;
+    in_unit = block & (g->stripe_blocks - 1);
+  } else {
+    unit = block / g->stripe_blocks;
+    in_unit = block % g->stripe_blocks;
+  }
+  if (g->disks_shift >= 0) {
+    *disk_num = unit & (g->num_disks - 1);
+    row = unit >> g->disks_shift;
+  } else {
+    *disk_num = unit % g->num_disks;
+    row = unit / g->num_disks;
+  }
+  *block_num = row * g->stripe_blocks + in_unit;
+}
+
+static inline uint32_t addr_disk(const block_geometry_t *g, uint32_t addr) {
+  uint32_t disk_num, block_num;
+  addr_locate(g, addr, &disk_num, &block_num);
+  return disk_num;
+}
+
+static inline uint32_t addr_block(const block_geometry_t *g, uint32_t addr) {
+  uint32_t disk_num, block_num;
+  addr_locate(g, addr, &disk_num, &block_num);
+  return block_num;
+}
+
+/* Start and end of the run of addresses around |addr| that lie contiguously
+ * on one disk: its disk in the linear layout, its stripe unit otherwise. */
+static inline uint32_t addr_run_start(const block_geometry_t *g, uint32_t addr) {
+  uint32_t run = g->stripe_blocks ? g->stripe_blocks * JBOD_BLOCK_SIZE : g->disk_size;
+  return addr - addr % run;
+}
+
+static inline uint64_t addr_run_end(const block_geometry_t *g, uint32_t addr) {
+  uint32_t run = g->stripe_blocks ? g->stripe_blocks * JBOD_BLOCK_SIZE : g->disk_size;
+  return (uint64_t)addr_run_start(g, addr) + run;
+}
+
+/* Block kernels, using AVX2 or NEON where the CPU has them, picked once at
+ * startup. block_copy and block_equal work on whole JBOD_BLOCK_SIZE blocks;
+ * block_fill sets |len| bytes to |c|. None of them needs aligned buffers. */
+void block_copy(uint8_t *dst, const uint8_t *src);
+void block_fill(uint8_t *dst, uint8_t c, size_t len);
+bool block_equal(const uint8_t *a, const uint8_t *b);
+
+/* Name of the kernels in use: "avx2", "neon" or "generic". */
+const char *block_kernels(void);
+
+#endif
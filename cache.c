@@ -1,173 +1,1612 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
 
+#include "block.h"
 #include "cache.h"
 #include "jbod.h"
+#include "pool.h"
 
-static cache_entry_t *cache = NULL;
-static int cache_size = 0;
-static int clock = 0;
-static int num_queries = 0;
-static int num_hits = 0;
+#define CACHE_NUM_KEYS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define CACHE_NO_TAG   0xFFFF
+#define CACHE_LINE     64
 
-/* Helper function to find a cache entry by disk and block number */
-static int find_cache_entry(int disk_num, int block_num) {
-    for (int i = 0; i < cache_size; i++) {
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
+/* Payloads are allocated in fixed-size chunks so that the cache can grow
+ * without moving blocks that are already resident. The chunks come from a
+ * pool of huge-page slabs, so resizing back and forth reuses them instead of
+ * going to the allocator, and a large cache spans few TLB entries. */
+#define CACHE_MAX_ENTRIES   4096
+#define CACHE_CHUNK_ENTRIES 64
+#define CACHE_MAX_CHUNKS    (CACHE_MAX_ENTRIES / CACHE_CHUNK_ENTRIES)
+
+_Static_assert(POOL_ALIGN % CACHE_LINE == 0, "payload chunks must be cache-line aligned");
+
+static pool_t chunk_pool = POOL_INITIALIZER(CACHE_CHUNK_ENTRIES * JBOD_BLOCK_SIZE, POOL_HUGE_PAGE);
+
+/* Resident queues an entry can be on, and ghost queues a key can be on. Each
+ * policy decides what the two queues of each kind mean. The admission window
+ * is the core's, and policies never see its entries. */
+#define QUEUE_NONE   0
+#define QUEUE_1      1
+#define QUEUE_2      2
+#define QUEUE_WINDOW 3
+
+/* The bytes of a block a partial write has filled in, one bit each. */
+typedef struct {
+    uint64_t bits[JBOD_BLOCK_SIZE / 64];
+} block_mask_t;
+
+/* A doubly linked queue, most recently pushed at the head. */
+typedef struct {
+    int16_t *prev;
+    int16_t *next;
+    int head;
+    int tail;
+    int len;
+} cache_list_t;
+
+/* The cache is split into shards by key, each with its own lock, entries,
+ * queues and policy state, so that accesses to different shards never wait
+ * for each other. Every key belongs to exactly one shard, which is the only
+ * one that touches the key's slots in the global per-key arrays below.
+ *
+ * Each shard is kept as a structure of arrays: the small per-entry metadata
+ * lives in compact parallel arrays so that probing and list maintenance stay
+ * within a few cache lines, and the block payloads live in aligned slab chunks
+ * that are only touched when data is actually copied in or out. */
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock; /* one shard per cache line */
+    uint16_t *tags;     /* cache_key() of each entry, or CACHE_NO_TAG */
+    int *stamps;        /* clock value of each entry's last access */
+    int16_t *prev_link; /* previous entry on its resident queue */
+    int16_t *next_link; /* next entry on its resident queue or the free list */
+    uint8_t *queue;     /* resident queue each entry is on */
+    uint8_t *ref_bits;  /* CLOCK reference bit of each entry */
+    uint8_t *dirty;     /* entry holds data not yet on the device */
+    uint8_t *partial;   /* entry holds only the bytes of |valid| */
+    block_mask_t *valid; /* bytes written to a partial entry */
+    uint8_t *chunks[CACHE_MAX_CHUNKS]; /* CACHE_CHUNK_ENTRIES payloads each */
+    int num_chunks;
+    int size;           /* entries in this shard */
+    int capacity;       /* entries the metadata arrays have room for */
+    int clock;
+    int free_head;      /* singly linked list (through next_link) of invalid entries */
+    cache_list_t t1, t2; /* resident queues, linked through prev_link/next_link */
+    cache_list_t b1, b2; /* ghost queues, linked through ghost_prev/ghost_next */
+    cache_list_t window; /* admission window, linked through prev_link/next_link */
+    uint8_t *sketch;    /* admission filter counters, or NULL, see below */
+    uint32_t sketch_mask; /* counters per row, minus one */
+    int sketch_adds;    /* lookups counted since the last aging */
+
+    /* policy state, see the policies below */
+    int clock_hand;
+    bool twoq_promote;
+    int arc_p;
+    bool arc_promote;
+    bool arc_from_b2;
+    bool arc_drop_t1;
+} cache_shard_t;
+
+static cache_shard_t *shards = NULL;
+static int num_shards = 0;
+static int cache_size = 0; /* entries over all shards */
+
+static atomic_int num_queries = 0;
+static atomic_int num_hits = 0;
+static atomic_int num_inserts = 0;
+static atomic_int num_evictions = 0;
+static atomic_int num_writebacks = 0;
+static atomic_int num_rejections = 0;
+static atomic_int num_fills = 0;
+
+/* Set in write-back mode: writes a dirty block to the device. */
+static cache_writeback_t writeback = NULL;
+
+/* Reads a block from the device to complete a partial entry. */
+static cache_fill_t fill = NULL;
+
+/* Dirty entries over all shards by disk, so that cache_flush_disk can tell
+ * without taking any lock that a disk has nothing to write back. */
+static atomic_int disk_dirty[JBOD_NUM_DISKS];
+
+/* Direct-mapped index from (disk, block) to the entry of its shard caching
+ * it, or -1. There are only JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK possible
+ * keys, so every key gets its own slot and there are no collisions. */
+static int16_t cache_index[CACHE_NUM_KEYS];
+
+/* Ghost queues remember recently evicted keys, not data, so they are linked
+ * through arrays indexed by key rather than by entry. */
+static int16_t ghost_prev[CACHE_NUM_KEYS];
+static int16_t ghost_next[CACHE_NUM_KEYS];
+static uint8_t ghost_queue[CACHE_NUM_KEYS];
+
+static inline int cache_key(int disk_num, int block_num) {
+    return block_key(disk_num, block_num);
+}
+
+static inline bool valid_location(int disk_num, int block_num) {
+    return disk_num >= 0 && disk_num < JBOD_NUM_DISKS &&
+           block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK;
+}
+
+/* Spreads neighbouring keys, which sequential I/O touches together, over
+ * different shards. */
+static inline cache_shard_t *key_shard(int key) {
+    return &shards[((uint32_t)key * 2654435761u >> 16) % num_shards];
+}
+
+static inline cache_shard_t *lock_key(int key) {
+    cache_shard_t *s = key_shard(key);
+    pthread_mutex_lock(&s->lock);
+    return s;
+}
+
+static inline uint8_t *entry_block(cache_shard_t *s, int i) {
+    return s->chunks[i / CACHE_CHUNK_ENTRIES] + (i % CACHE_CHUNK_ENTRIES) * JBOD_BLOCK_SIZE;
+}
+
+static void list_init(cache_list_t *l, int16_t *prev, int16_t *next) {
+    l->prev = prev;
+    l->next = next;
+    l->head = l->tail = -1;
+    l->len = 0;
+}
+
+/* Links |i| at the head of |l|. */
+static void list_push(cache_list_t *l, int i) {
+    l->prev[i] = -1;
+    l->next[i] = l->head;
+    if (l->head != -1) {
+        l->prev[l->head] = i;
+    } else {
+        l->tail = i;
+    }
+    l->head = i;
+    l->len++;
+}
+
+/* Unlinks |i| from |l|. */
+static void list_unlink(cache_list_t *l, int i) {
+    if (l->prev[i] != -1) {
+        l->next[l->prev[i]] = l->next[i];
+    } else {
+        l->head = l->next[i];
+    }
+    if (l->next[i] != -1) {
+        l->prev[l->next[i]] = l->prev[i];
+    } else {
+        l->tail = l->prev[i];
+    }
+    l->len--;
+}
+
+/* Puts |to| in the place of |from| on |l|. */
+static void list_replace(cache_list_t *l, int from, int to) {
+    l->prev[to] = l->prev[from];
+    l->next[to] = l->next[from];
+    if (l->prev[to] != -1) {
+        l->next[l->prev[to]] = to;
+    } else {
+        l->head = to;
+    }
+    if (l->next[to] != -1) {
+        l->prev[l->next[to]] = to;
+    } else {
+        l->tail = to;
+    }
+}
+
+/* Unlinks and returns the tail of |l|, or -1 if it is empty. */
+static int list_pop_tail(cache_list_t *l) {
+    int i = l->tail;
+    if (i != -1) {
+        list_unlink(l, i);
+    }
+    return i;
+}
+
+static inline cache_list_t *resident_list(cache_shard_t *s, int i) {
+    return s->queue[i] == QUEUE_2 ? &s->t2 : s->queue[i] == QUEUE_WINDOW ? &s->window : &s->t1;
+}
+
+/* Puts entry |i| at the head of resident queue |q|. */
+static void resident_push(cache_shard_t *s, int i, uint8_t q) {
+    s->queue[i] = q;
+    list_push(q == QUEUE_2 ? &s->t2 : &s->t1, i);
+}
+
+/* Moves entry |i| to the head of resident queue |q|. */
+static void resident_move(cache_shard_t *s, int i, uint8_t q) {
+    list_unlink(resident_list(s, i), i);
+    resident_push(s, i, q);
+}
+
+/* Evicts the tail of resident queue |l| and returns its entry. */
+static int resident_pop(cache_shard_t *s, cache_list_t *l) {
+    int i = list_pop_tail(l);
+    if (i != -1) {
+        s->queue[i] = QUEUE_NONE;
+    }
+    return i;
+}
+
+/* Remembers |key| at the head of ghost queue |q|. */
+static void ghost_push(cache_shard_t *s, int key, uint8_t q) {
+    ghost_queue[key] = q;
+    list_push(q == QUEUE_2 ? &s->b2 : &s->b1, key);
+}
+
+/* Forgets |key| if it is on a ghost queue. */
+static void ghost_remove(cache_shard_t *s, int key) {
+    if (ghost_queue[key] != QUEUE_NONE) {
+        list_unlink(ghost_queue[key] == QUEUE_2 ? &s->b2 : &s->b1, key);
+        ghost_queue[key] = QUEUE_NONE;
+    }
+}
+
+/* Forgets the oldest key on ghost queue |l|. */
+static void ghost_drop_tail(cache_list_t *l) {
+    int key = list_pop_tail(l);
+    if (key != -1) {
+        ghost_queue[key] = QUEUE_NONE;
+    }
+}
+
+/* Eviction policy interface. The core keeps the index, the free list and the
+ * payloads; a policy only orders the resident entries of a shard.
+ *   reset  - forget all state, every entry is free
+ *   miss   - optional, a block with |key| is about to be inserted
+ *   evict  - the shard is full, pick a resident entry, unlink and return it
+ *   victim - the entry evict would pick now, without changing anything
+ *   admit  - entry |i| now holds a new block
+ *   access - entry |i| was hit by a lookup or update
+ *   resize - optional, the shard's size has changed */
+typedef struct {
+    const char *name;
+    void (*reset)(cache_shard_t *s);
+    void (*miss)(cache_shard_t *s, int key);
+    int (*evict)(cache_shard_t *s);
+    int (*victim)(cache_shard_t *s);
+    void (*admit)(cache_shard_t *s, int i);
+    void (*access)(cache_shard_t *s, int i);
+    void (*resize)(cache_shard_t *s);
+} cache_policy_ops_t;
+
+/* Points the resident queues at the current link arrays, which move when the
+ * shard is resized. */
+static void queues_attach(cache_shard_t *s) {
+    s->t1.prev = s->t2.prev = s->window.prev = s->prev_link;
+    s->t1.next = s->t2.next = s->window.next = s->next_link;
+}
+
+static void queues_reset(cache_shard_t *s) {
+    list_init(&s->t1, s->prev_link, s->next_link);
+    list_init(&s->t2, s->prev_link, s->next_link);
+    list_init(&s->window, s->prev_link, s->next_link);
+    list_init(&s->b1, ghost_prev, ghost_next);
+    list_init(&s->b2, ghost_prev, ghost_next);
+}
+
+/* MRU and LRU keep a single recency queue, most recent at the head. */
+static int mru_evict(cache_shard_t *s) {
+    int i = s->t1.head;
+    if (i != -1) {
+        list_unlink(&s->t1, i);
+        s->queue[i] = QUEUE_NONE;
+    }
+    return i;
+}
+
+static int lru_evict(cache_shard_t *s) {
+    return resident_pop(s, &s->t1);
+}
+
+static int mru_victim(cache_shard_t *s) {
+    return s->t1.head;
+}
+
+static int lru_victim(cache_shard_t *s) {
+    return s->t1.tail;
+}
+
+static void recency_admit(cache_shard_t *s, int i) {
+    resident_push(s, i, QUEUE_1);
+}
+
+static void recency_access(cache_shard_t *s, int i) {
+    resident_move(s, i, QUEUE_1);
+}
+
+/* CLOCK (second chance): a hand sweeps the entries in slot order, clearing
+ * reference bits, and evicts the first entry whose bit is already clear. */
+static void clock_reset(cache_shard_t *s) {
+    s->clock_hand = 0;
+}
+
+static int clock_evict(cache_shard_t *s) {
+    for (;;) {
+        int i = s->clock_hand;
+        s->clock_hand = (s->clock_hand + 1) % s->size;
+        if (s->tags[i] == CACHE_NO_TAG || s->queue[i] == QUEUE_WINDOW) {
+            continue;
+        }
+        if (s->ref_bits[i]) {
+            s->ref_bits[i] = 0;
+        } else {
             return i;
         }
     }
-    return -1;
 }
 
-/* Helper function to find the MRU cache entry index */
-static int find_mru_entry(void) {
-    int mru_index = -1;
-    int max_clock = -1;
-    for (int i = 0; i < cache_size; i++) {
-        if (cache[i].valid && cache[i].clock_accesses > max_clock) {
-            max_clock = cache[i].clock_accesses;
-            mru_index = i;
+/* The first entry from the hand with a clear bit, or, if every bit is set,
+ * the first one the hand reaches, whose bit evict would have cleared. */
+static int clock_victim(cache_shard_t *s) {
+    int first = -1;
+    for (int n = 0; n < s->size; n++) {
+        int i = (s->clock_hand + n) % s->size;
+        if (s->tags[i] == CACHE_NO_TAG || s->queue[i] == QUEUE_WINDOW) {
+            continue;
+        }
+        if (!s->ref_bits[i]) {
+            return i;
+        }
+        if (first == -1) {
+            first = i;
         }
     }
-    return mru_index;
+    return first;
 }
 
-/* Helper function to find an invalid cache entry */
-static int find_invalid_entry(void) {
-    for (int i = 0; i < cache_size; i++) {
-        if (!cache[i].valid) {
-            return i;
+static void clock_admit(cache_shard_t *s, int i) {
+    s->ref_bits[i] = 0;
+}
+
+static void clock_access(cache_shard_t *s, int i) {
+    s->ref_bits[i] = 1;
+}
+
+static void clock_resize(cache_shard_t *s) {
+    s->clock_hand %= s->size;
+}
+
+/* 2Q (Johnson & Shasha): new blocks enter the FIFO A1in (t1); blocks evicted
+ * from A1in are remembered in the ghost FIFO A1out (b1); a miss on a key in
+ * A1out means the block is re-referenced, and it goes to the LRU queue Am
+ * (t2). A1in holds about a quarter of the shard, A1out half of it. */
+static void twoq_reset(cache_shard_t *s) {
+    queues_reset(s);
+    s->twoq_promote = false;
+}
+
+static void twoq_miss(cache_shard_t *s, int key) {
+    s->twoq_promote = ghost_queue[key] == QUEUE_1;
+    ghost_remove(s, key);
+}
+
+static int twoq_kout(cache_shard_t *s) {
+    return s->size / 2 > 0 ? s->size / 2 : 1;
+}
+
+static inline bool twoq_evicts_t1(cache_shard_t *s) {
+    int kin = s->size / 4 > 0 ? s->size / 4 : 1;
+    return s->t1.len > kin || s->t2.len == 0;
+}
+
+static int twoq_evict(cache_shard_t *s) {
+    if (twoq_evicts_t1(s)) {
+        int i = resident_pop(s, &s->t1);
+        ghost_push(s, s->tags[i], QUEUE_1);
+        if (s->b1.len > twoq_kout(s)) {
+            ghost_drop_tail(&s->b1);
         }
+        return i;
     }
-    return -1;
+    return resident_pop(s, &s->t2);
+}
+
+static int twoq_victim(cache_shard_t *s) {
+    return twoq_evicts_t1(s) ? s->t1.tail : s->t2.tail;
+}
+
+static void twoq_admit(cache_shard_t *s, int i) {
+    resident_push(s, i, s->twoq_promote ? QUEUE_2 : QUEUE_1);
+    s->twoq_promote = false;
+}
+
+static void twoq_access(cache_shard_t *s, int i) {
+    if (s->queue[i] == QUEUE_2) {
+        resident_move(s, i, QUEUE_2);
+    }
+}
+
+static void twoq_resize(cache_shard_t *s) {
+    while (s->b1.len > twoq_kout(s)) {
+        ghost_drop_tail(&s->b1);
+    }
+}
+
+/* ARC (Megiddo & Modha): T1 (t1) holds blocks seen once recently, T2 (t2)
+ * blocks seen at least twice, and B1/B2 (b1/b2) the keys recently evicted from
+ * each. Ghost hits move the target size |arc_p| of T1 towards whichever side
+ * would have hit. |arc_promote| is set when the pending key was on a ghost
+ * queue, |arc_from_b2| when it was on B2, and |arc_drop_t1| when T1 must be
+ * evicted from without remembering the victim. */
+static void arc_reset(cache_shard_t *s) {
+    queues_reset(s);
+    s->arc_p = 0;
+    s->arc_promote = s->arc_from_b2 = s->arc_drop_t1 = false;
+}
+
+static void arc_miss(cache_shard_t *s, int key) {
+    int c = s->size;
+    cache_list_t *t1 = &s->t1, *t2 = &s->t2, *b1 = &s->b1, *b2 = &s->b2;
+    s->arc_promote = s->arc_from_b2 = s->arc_drop_t1 = false;
+    if (ghost_queue[key] == QUEUE_1) {
+        int delta = b1->len >= b2->len ? 1 : b2->len / b1->len;
+        s->arc_p = s->arc_p + delta < c ? s->arc_p + delta : c;
+        s->arc_promote = true;
+    } else if (ghost_queue[key] == QUEUE_2) {
+        int delta = b2->len >= b1->len ? 1 : b1->len / b2->len;
+        s->arc_p = s->arc_p - delta > 0 ? s->arc_p - delta : 0;
+        s->arc_promote = s->arc_from_b2 = true;
+    } else if (t1->len + b1->len >= c) {
+        if (t1->len < c) {
+            ghost_drop_tail(b1);
+        } else {
+            s->arc_drop_t1 = true;
+        }
+    } else if (t1->len + t2->len + b1->len + b2->len >= 2 * c) {
+        ghost_drop_tail(b2);
+    }
+    ghost_remove(s, key);
+}
+
+static int arc_evict(cache_shard_t *s) {
+    if (s->arc_drop_t1) {
+        s->arc_drop_t1 = false;
+        return resident_pop(s, &s->t1);
+    }
+    int t1_len = s->t1.len;
+    if (t1_len > 0 && (t1_len > s->arc_p || (s->arc_from_b2 && t1_len == s->arc_p) ||
+                       s->t2.len == 0)) {
+        int i = resident_pop(s, &s->t1);
+        ghost_push(s, s->tags[i], QUEUE_1);
+        return i;
+    }
+    int i = resident_pop(s, &s->t2);
+    ghost_push(s, s->tags[i], QUEUE_2);
+    return i;
+}
+
+/* Called before arc_miss has looked at the pending key, so the choice it
+ * makes for keys on a ghost queue is not known yet; this is the choice for a
+ * key that is on none. */
+static int arc_victim(cache_shard_t *s) {
+    int t1_len = s->t1.len;
+    if (t1_len > 0 && (t1_len > s->arc_p || s->t2.len == 0)) {
+        return s->t1.tail;
+    }
+    return s->t2.tail;
+}
+
+static void arc_admit(cache_shard_t *s, int i) {
+    resident_push(s, i, s->arc_promote ? QUEUE_2 : QUEUE_1);
+    s->arc_promote = s->arc_from_b2 = false;
+}
+
+static void arc_access(cache_shard_t *s, int i) {
+    resident_move(s, i, QUEUE_2);
+}
+
+/* Brings the target and the ghost queues back within the bounds for the new
+ * shard size: |T1| + |B1| <= c and |T1| + |T2| + |B1| + |B2| <= 2c. */
+static void arc_resize(cache_shard_t *s) {
+    int c = s->size;
+    cache_list_t *t1 = &s->t1, *t2 = &s->t2, *b1 = &s->b1, *b2 = &s->b2;
+    if (s->arc_p > c) {
+        s->arc_p = c;
+    }
+    while (b1->len > 0 && t1->len + b1->len > c) {
+        ghost_drop_tail(b1);
+    }
+    while (b2->len > 0 && t1->len + t2->len + b1->len + b2->len > 2 * c) {
+        ghost_drop_tail(b2);
+    }
+}
+
+static const cache_policy_ops_t policies[CACHE_NUM_POLICIES] = {
+    [CACHE_POLICY_MRU]   = { "mru",   queues_reset, NULL,      mru_evict,   mru_victim,   recency_admit, recency_access, NULL },
+    [CACHE_POLICY_LRU]   = { "lru",   queues_reset, NULL,      lru_evict,   lru_victim,   recency_admit, recency_access, NULL },
+    [CACHE_POLICY_CLOCK] = { "clock", clock_reset,  NULL,      clock_evict, clock_victim, clock_admit,   clock_access,   clock_resize },
+    [CACHE_POLICY_2Q]    = { "2q",    twoq_reset,   twoq_miss, twoq_evict,  twoq_victim,  twoq_admit,    twoq_access,    twoq_resize },
+    [CACHE_POLICY_ARC]   = { "arc",   arc_reset,    arc_miss,  arc_evict,   arc_victim,   arc_admit,     arc_access,     arc_resize },
+};
+
+static const cache_policy_ops_t *policy = &policies[CACHE_POLICY_MRU];
+static cache_policy_t policy_id = CACHE_POLICY_MRU;
+
+/* W-TinyLFU admission (Einziger et al.). A count-min sketch per shard
+ * estimates how often each key has been looked up lately. New blocks enter an
+ * LRU window of a fifth of the shard, which keeps short-range reuse (such as
+ * several small reads of one block) hitting; the block leaving the window
+ * only joins the entries the policy manages if it is estimated to be hotter
+ * than the one the policy would evict for it, and is dropped otherwise.
+ * One-off scans then pass through the window without pushing out blocks that
+ * are actually reused. Each of the SKETCH_ROWS rows has a power-of-two number
+ * of counters, at least the shard's size; counters saturate at SKETCH_MAX,
+ * and every SKETCH_SAMPLE lookups per entry all of them are halved, so that
+ * old popularity fades. */
+#define SKETCH_ROWS   4
+#define SKETCH_MIN    64
+#define SKETCH_MAX    15
+#define SKETCH_SAMPLE 10
+
+static const uint32_t sketch_seeds[SKETCH_ROWS] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu,
+};
+
+static inline uint8_t *sketch_counter(cache_shard_t *s, int row, int key) {
+    uint32_t h = ((uint32_t)key + 1) * sketch_seeds[row];
+    h ^= h >> 15;
+    return &s->sketch[row * (s->sketch_mask + 1) + (h & s->sketch_mask)];
+}
+
+static int sketch_estimate(cache_shard_t *s, int key) {
+    int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        int c = *sketch_counter(s, row, key);
+        min = c < min ? c : min;
+    }
+    return min;
+}
+
+static void sketch_add(cache_shard_t *s, int key) {
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t *c = sketch_counter(s, row, key);
+        if (*c < SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+    if (++s->sketch_adds >= SKETCH_SAMPLE * s->size) {
+        for (uint32_t i = 0; i < SKETCH_ROWS * (s->sketch_mask + 1); i++) {
+            s->sketch[i] >>= 1;
+        }
+        s->sketch_adds /= 2;
+    }
+}
+
+/* Returns 0 on success and -1 on failure. Gives |s| an empty sketch sized
+ * for its entries, unless it already has one of that size. */
+static int sketch_reserve(cache_shard_t *s) {
+    uint32_t width = SKETCH_MIN;
+    while (width < (uint32_t)s->size) {
+        width *= 2;
+    }
+    if (s->sketch != NULL && s->sketch_mask + 1 == width) {
+        return 0;
+    }
+    uint8_t *sketch = calloc(SKETCH_ROWS, width);
+    if (sketch == NULL) {
+        return -1;
+    }
+    free(s->sketch);
+    s->sketch = sketch;
+    s->sketch_mask = width - 1;
+    s->sketch_adds = 0;
+    return 0;
+}
+
+/* Marks entry |i| as the most recent access. */
+static void touch_entry(cache_shard_t *s, int i) {
+    s->clock++;
+    s->stamps[i] = s->clock;
+    if (s->queue[i] == QUEUE_WINDOW) {
+        list_unlink(&s->window, i);
+        list_push(&s->window, i);
+    } else {
+        policy->access(s, i);
+    }
+}
+
+/* Helper function to take an invalid entry off the shard's free list */
+static int find_invalid_entry(cache_shard_t *s) {
+    int i = s->free_head;
+    if (i != -1) {
+        s->free_head = s->next_link[i];
+    }
+    return i;
+}
+
+/* Threads every invalid entry onto the free list, lowest index first. */
+static void rebuild_free_list(cache_shard_t *s) {
+    s->free_head = -1;
+    for (int i = s->size - 1; i >= 0; i--) {
+        if (s->tags[i] == CACHE_NO_TAG) {
+            s->next_link[i] = s->free_head;
+            s->free_head = i;
+        }
+    }
+}
+
+/* Resets the policy and free list so that all entries of |s| are free. The
+ * caller resets the per-key arrays. */
+static void reset_entries(cache_shard_t *s) {
+    for (int i = 0; i < s->size; i++) {
+        s->tags[i] = CACHE_NO_TAG;
+        s->queue[i] = QUEUE_NONE;
+        s->ref_bits[i] = 0;
+        s->dirty[i] = 0;
+        s->partial[i] = 0;
+    }
+    s->clock = 0;
+    queues_reset(s);
+    policy->reset(s);
+    rebuild_free_list(s);
+}
+
+/* Returns |p| grown to |size| bytes, or |p| unchanged with |*ok| cleared if
+ * that fails. Does nothing once |*ok| is clear, so that a run of calls stops
+ * at the first failure. */
+static void *grow_array(void *p, size_t size, bool *ok) {
+    if (!*ok) {
+        return p;
+    }
+    void *resized = realloc(p, size);
+    if (resized == NULL) {
+        *ok = false;
+        return p;
+    }
+    return resized;
+}
+
+/* Returns 0 on success and -1 on failure. Makes the metadata arrays of |s|
+ * big enough for |num_entries|. They grow geometrically and never shrink, so
+ * resizing back and forth only reallocates the first time a size is reached.
+ * On failure the arrays that did grow keep their new size and contents, and
+ * |s| keeps its old capacity. */
+static int reserve_metadata(cache_shard_t *s, int num_entries) {
+    if (num_entries <= s->capacity) {
+        return 0;
+    }
+    int capacity = 2 * s->capacity < CACHE_MAX_ENTRIES ? 2 * s->capacity : CACHE_MAX_ENTRIES;
+    if (capacity < num_entries) {
+        capacity = num_entries;
+    }
+    bool ok = true;
+    s->tags = grow_array(s->tags, sizeof(*s->tags) * capacity, &ok);
+    s->stamps = grow_array(s->stamps, sizeof(*s->stamps) * capacity, &ok);
+    s->prev_link = grow_array(s->prev_link, sizeof(*s->prev_link) * capacity, &ok);
+    s->next_link = grow_array(s->next_link, sizeof(*s->next_link) * capacity, &ok);
+    s->queue = grow_array(s->queue, sizeof(*s->queue) * capacity, &ok);
+    s->ref_bits = grow_array(s->ref_bits, sizeof(*s->ref_bits) * capacity, &ok);
+    s->dirty = grow_array(s->dirty, sizeof(*s->dirty) * capacity, &ok);
+    s->partial = grow_array(s->partial, sizeof(*s->partial) * capacity, &ok);
+    s->valid = grow_array(s->valid, sizeof(*s->valid) * capacity, &ok);
+    // The links may have moved even if a later array failed to grow, and
+    // the queues must follow them either way
+    queues_attach(s);
+    if (!ok) {
+        return -1;
+    }
+    s->capacity = capacity;
+    return 0;
+}
+
+/* Returns 0 on success and -1 on failure. Allocates or frees payload chunks
+ * so that |s| has exactly enough for |num_entries|. Chunks that stay are
+ * never moved. */
+static int resize_chunks(cache_shard_t *s, int num_entries) {
+    int needed = (num_entries + CACHE_CHUNK_ENTRIES - 1) / CACHE_CHUNK_ENTRIES;
+    while (s->num_chunks < needed) {
+        s->chunks[s->num_chunks] = pool_get(&chunk_pool);
+        if (s->chunks[s->num_chunks] == NULL) {
+            return -1;
+        }
+        s->num_chunks++;
+    }
+    while (s->num_chunks > needed) {
+        s->num_chunks--;
+        pool_put(&chunk_pool, s->chunks[s->num_chunks]);
+        s->chunks[s->num_chunks] = NULL;
+    }
+    return 0;
+}
+
+static void free_storage(void) {
+    for (int n = 0; n < num_shards; n++) {
+        cache_shard_t *s = &shards[n];
+        free(s->tags);
+        free(s->stamps);
+        free(s->prev_link);
+        free(s->next_link);
+        free(s->queue);
+        free(s->ref_bits);
+        free(s->dirty);
+        free(s->partial);
+        free(s->valid);
+        free(s->sketch);
+        resize_chunks(s, 0);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+    pool_destroy(&chunk_pool);
+}
+
+/* Returns the number of entries shard |n| gets out of |num_entries|. */
+static inline int shard_size(int num_entries, int n) {
+    return num_entries / num_shards + (n < num_entries % num_shards);
+}
+
+/* Returns 0 on success and -1 on failure. Reads the rest of the partial
+ * entry |i| of |s| from the device, keeping the bytes written to it. */
+static int complete_entry(cache_shard_t *s, int i) {
+    int key = s->tags[i];
+    uint8_t dev[JBOD_BLOCK_SIZE];
+    if (fill == NULL || fill(key_disk(key), key_block(key), dev) != 1) {
+        return -1;
+    }
+    uint8_t *block = entry_block(s, i);
+    const block_mask_t *valid = &s->valid[i];
+    for (int w = 0; w < JBOD_BLOCK_SIZE / 64; w++) {
+        uint64_t missing = ~valid->bits[w];
+        while (missing != 0) {
+            int b = w * 64 + __builtin_ctzll(missing);
+            block[b] = dev[b];
+            missing &= missing - 1;
+        }
+    }
+    s->partial[i] = 0;
+    atomic_fetch_add_explicit(&num_fills, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Returns 0 on success and -1 on failure. Writes entry |i| of |s| back to
+ * the device if it is dirty, completing it first if it is partial. */
+static int clean_entry(cache_shard_t *s, int i) {
+    if (!s->dirty[i]) {
+        return 0;
+    }
+    int key = s->tags[i];
+    if (s->partial[i] && complete_entry(s, i) != 0) {
+        return -1;
+    }
+    if (writeback == NULL ||
+        writeback(key_disk(key), key_block(key),
+                  entry_block(s, i)) != 1) {
+        return -1;
+    }
+    s->dirty[i] = 0;
+    atomic_fetch_sub_explicit(&disk_dirty[key_disk(key)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&num_writebacks, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Marks entry |i| of |s| as holding data not yet on the device. */
+static void mark_dirty(cache_shard_t *s, int i) {
+    if (!s->dirty[i]) {
+        s->dirty[i] = 1;
+        atomic_fetch_add_explicit(&disk_dirty[key_disk(s->tags[i])], 1, memory_order_relaxed);
+    }
+}
+
+/* Returns 0 on success and -1 on failure. Makes the victim |i| of |s| clean.
+ * If it is dirty, the other dirty entries of |s| on the same disk are written
+ * back with it in block order, since the head has to go there anyway, and
+ * they are likely to be evicted soon as well. Fails only if |i| itself could
+ * not be written back. */
+static int clean_victim(cache_shard_t *s, int i) {
+    if (!s->dirty[i]) {
+        return 0;
+    }
+    int disk = key_disk(s->tags[i]);
+    uint64_t blocks[JBOD_NUM_BLOCKS_PER_DISK / 64] = { 0 };
+    for (int e = 0; e < s->size; e++) {
+        if (s->tags[e] != CACHE_NO_TAG && s->dirty[e] && key_disk(s->tags[e]) == disk) {
+            int b = key_block(s->tags[e]);
+            blocks[b / 64] |= 1ull << (b % 64);
+        }
+    }
+    for (int w = 0; w < JBOD_NUM_BLOCKS_PER_DISK / 64; w++) {
+        while (blocks[w] != 0) {
+            int b = w * 64 + __builtin_ctzll(blocks[w]);
+            // The others just stay dirty if they cannot be written
+            clean_entry(s, cache_index[cache_key(disk, b)]);
+            blocks[w] &= blocks[w] - 1;
+        }
+    }
+    return s->dirty[i] ? -1 : 0;
+}
+
+/* Returns the index of an entry the policy evicted from |s|, now invalid and
+ * out of the index, or -1 on failure. A dirty victim is written back first,
+ * see clean_victim; if that fails it stays resident. */
+static int evict_entry(cache_shard_t *s) {
+    int index = policy->evict(s);
+    if (index == -1) {
+        // Should not happen, but handle just in case
+        return -1;
+    }
+    if (clean_victim(s, index) != 0) {
+        policy->admit(s, index);
+        return -1;
+    }
+    cache_index[s->tags[index]] = -1;
+    s->tags[index] = CACHE_NO_TAG;
+    s->queue[index] = QUEUE_NONE;
+    atomic_fetch_add_explicit(&num_evictions, 1, memory_order_relaxed);
+    return index;
+}
+
+/* Inserts a clean entry for |key|, which must belong to |s| and not be cached
+ * yet, evicting if the shard is full, and copies the block at |buf| into it
+ * unless |buf| is NULL, in which case the caller fills it. Returns the new
+ * entry's index or -1 on failure. */
+static int insert_entry(cache_shard_t *s, int key, const uint8_t *buf) {
+    if (policy->miss != NULL) {
+        policy->miss(s, key);
+    }
+    // Find an invalid entry
+    int index = find_invalid_entry(s);
+    if (index == -1) {
+        // Shard is full, let the policy pick a victim
+        index = evict_entry(s);
+        if (index == -1) {
+            return -1;
+        }
+    }
+    // Insert the new entry
+    s->tags[index] = key;
+    s->dirty[index] = 0;
+    s->partial[index] = 0;
+    if (buf != NULL) {
+        block_copy(entry_block(s, index), buf);
+    }
+    cache_index[key] = index;
+    s->clock++;
+    s->stamps[index] = s->clock;
+    policy->admit(s, index);
+    atomic_fetch_add_explicit(&num_inserts, 1, memory_order_relaxed);
+    return index;
+}
+
+/* Entries the admission window of a shard of |size| entries holds. */
+static inline int window_size(int size) {
+    return size / 5 > 0 ? size / 5 : 1;
+}
+
+/* Hands the oldest window entry of |s| over to the policy. */
+static void window_promote(cache_shard_t *s) {
+    int c = s->window.tail;
+    list_unlink(&s->window, c);
+    s->queue[c] = QUEUE_NONE;
+    if (policy->miss != NULL) {
+        policy->miss(s, s->tags[c]);
+    }
+    policy->admit(s, c);
+}
+
+/* Returns the index of a free entry of the full shard |s|, made by either
+ * promoting the oldest window entry over the policy's victim, or dropping
+ * it, whichever is estimated to be looked up less. -1 on failure. */
+static int window_make_room(cache_shard_t *s) {
+    int c = s->window.tail;
+    int victim = policy->victim(s);
+    if (victim != -1 && sketch_estimate(s, s->tags[c]) > sketch_estimate(s, s->tags[victim])) {
+        if (policy->miss != NULL) {
+            policy->miss(s, s->tags[c]);
+        }
+        int index = evict_entry(s);
+        if (index != -1) {
+            list_unlink(&s->window, c);
+            s->queue[c] = QUEUE_NONE;
+            policy->admit(s, c);
+            return index;
+        }
+    }
+    if (clean_victim(s, c) != 0) {
+        return -1;
+    }
+    list_unlink(&s->window, c);
+    cache_index[s->tags[c]] = -1;
+    s->tags[c] = CACHE_NO_TAG;
+    s->queue[c] = QUEUE_NONE;
+    atomic_fetch_add_explicit(&num_evictions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&num_rejections, 1, memory_order_relaxed);
+    return c;
+}
+
+/* Inserts a clean entry for |key| into the window of |s|, which must have a
+ * sketch, the way insert_entry does. */
+static int insert_windowed(cache_shard_t *s, int key, const uint8_t *buf) {
+    int index = find_invalid_entry(s);
+    if (index == -1) {
+        // A window that is still filling up takes the policy's victim
+        index = s->window.len >= window_size(s->size) ? window_make_room(s) : evict_entry(s);
+        if (index == -1) {
+            return -1;
+        }
+    }
+    s->tags[index] = key;
+    s->dirty[index] = 0;
+    s->partial[index] = 0;
+    block_copy(entry_block(s, index), buf);
+    cache_index[key] = index;
+    s->clock++;
+    s->stamps[index] = s->clock;
+    s->queue[index] = QUEUE_WINDOW;
+    list_push(&s->window, index);
+    // The window holds only its share of the shard; the rest is the policy's
+    while (s->window.len > window_size(s->size)) {
+        window_promote(s);
+    }
+    atomic_fetch_add_explicit(&num_inserts, 1, memory_order_relaxed);
+    return index;
 }
 
 int cache_create(int num_entries) {
-    if (cache != NULL || num_entries < 2 || num_entries > 4096) {
+    return cache_create_with_policy(num_entries, CACHE_POLICY_MRU);
+}
+
+int cache_create_with_policy(int num_entries, cache_policy_t new_policy) {
+    return cache_create_sharded(num_entries, new_policy, 1);
+}
+
+int cache_create_sharded(int num_entries, cache_policy_t new_policy, int new_num_shards) {
+    if (shards != NULL || num_entries < 2 || num_entries > CACHE_MAX_ENTRIES ||
+        new_policy < 0 || new_policy >= CACHE_NUM_POLICIES ||
+        new_num_shards < 1 || num_entries < 2 * new_num_shards) {
         return -1;
     }
-    cache = (cache_entry_t *)malloc(sizeof(cache_entry_t) * num_entries);
-    if (cache == NULL) {
+    shards = aligned_alloc(CACHE_LINE, sizeof(*shards) * new_num_shards);
+    if (shards == NULL) {
         return -1;
     }
+    memset(shards, 0, sizeof(*shards) * new_num_shards);
+    num_shards = new_num_shards;
+    for (int n = 0; n < num_shards; n++) {
+        pthread_mutex_init(&shards[n].lock, NULL);
+    }
+    for (int n = 0; n < num_shards; n++) {
+        cache_shard_t *s = &shards[n];
+        s->size = shard_size(num_entries, n);
+        if (reserve_metadata(s, s->size) != 0 || resize_chunks(s, s->size) != 0) {
+            free_storage();
+            return -1;
+        }
+    }
+    policy_id = new_policy;
+    policy = &policies[new_policy];
     cache_size = num_entries;
-    clock = 0;
-    for (int i = 0; i < cache_size; i++) {
-        cache[i].valid = false;
+    for (int k = 0; k < CACHE_NUM_KEYS; k++) {
+        cache_index[k] = -1;
+    }
+    memset(ghost_queue, QUEUE_NONE, sizeof(ghost_queue));
+    for (int n = 0; n < num_shards; n++) {
+        reset_entries(&shards[n]);
     }
     return 1;
 }
 
 int cache_destroy(void) {
-    if (cache == NULL) {
+    if (shards == NULL) {
         return -1;
     }
-    free(cache);
-    cache = NULL;
+    // Dirty blocks are lost if this fails; callers flush while they can
+    cache_flush();
+    writeback = NULL;
+    fill = NULL;
+    free_storage();
     cache_size = 0;
-    clock = 0;
-    num_queries = 0;
-    num_hits = 0;
+    for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+        atomic_store(&disk_dirty[d], 0);
+    }
+    cache_reset_stats();
     return 1;
 }
 
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
-    if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0) {
+    if (!cache_enabled() || buf == NULL || !valid_location(disk_num, block_num)) {
         return -1;
     }
-    num_queries++;
-    int index = find_cache_entry(disk_num, block_num);
+    atomic_fetch_add_explicit(&num_queries, 1, memory_order_relaxed);
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    int index = cache_index[key];
+    if (index != -1 && s->partial[index] && complete_entry(s, index) != 0) {
+        // Treat it as a miss; the caller's device read will fail the same way
+        index = -1;
+    }
     if (index != -1) {
-        memcpy(buf, cache[index].block, JBOD_BLOCK_SIZE);
-        num_hits++;
-        clock++;
-        cache[index].clock_accesses = clock;
-        return 1;
+        block_copy(buf, entry_block(s, index));
+        touch_entry(s, index);
     }
-    return -1;
+    if (s->sketch != NULL) {
+        sketch_add(s, key);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (index == -1) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&num_hits, 1, memory_order_relaxed);
+    return 1;
+}
+
+bool cache_contains(int disk_num, int block_num) {
+    if (!cache_enabled() || !valid_location(disk_num, block_num)) {
+        return false;
+    }
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    bool found = cache_index[key] != -1;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+int cache_probe(int disk_num, int block_num, uint8_t *buf) {
+    if (!cache_enabled() || buf == NULL || !valid_location(disk_num, block_num)) {
+        return -1;
+    }
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    int index = cache_index[key];
+    // A partial entry would have to be completed from the device first
+    if (index != -1 && !s->partial[index]) {
+        block_copy(buf, entry_block(s, index));
+    } else {
+        index = -1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return index == -1 ? -1 : 1;
 }
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
-    if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0) {
+    if (!cache_enabled() || buf == NULL || !valid_location(disk_num, block_num)) {
         return;
     }
-    int index = find_cache_entry(disk_num, block_num);
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    int index = cache_index[key];
     if (index != -1) {
-        memcpy(cache[index].block, buf, JBOD_BLOCK_SIZE);
-        clock++;
-        cache[index].clock_accesses = clock;
+        block_copy(entry_block(s, index), buf);
+        s->partial[index] = 0;
+        touch_entry(s, index);
     }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Returns true if making room in the full shard |s| could write a dirty
+ * entry back. With a window it is either the window's candidate or the
+ * policy's victim that goes. */
+static bool victim_dirty(cache_shard_t *s) {
+    int victim = policy->victim(s);
+    if (victim != -1 && s->dirty[victim]) {
+        return true;
+    }
+    return s->sketch != NULL && s->window.len >= window_size(s->size) &&
+           s->dirty[s->window.tail];
 }
 
 int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
-    if (!cache_enabled() || buf == NULL || disk_num < 0 || block_num < 0) {
+    if (!cache_enabled() || buf == NULL || !valid_location(disk_num, block_num)) {
         return -1;
     }
-    // Check for existing entry
-    if (find_cache_entry(disk_num, block_num) != -1) {
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    // Check for existing entry. A clean block is not worth a write-back,
+    // which would take the head away from where the caller is working.
+    int rc = -1;
+    if (cache_index[key] == -1 && (s->free_head != -1 || !victim_dirty(s)) &&
+        (s->sketch != NULL ? insert_windowed(s, key, buf) : insert_entry(s, key, buf)) != -1) {
+        rc = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+int cache_write(int disk_num, int block_num, const uint8_t *buf) {
+    if (!cache_enabled() || writeback == NULL || buf == NULL ||
+        !valid_location(disk_num, block_num)) {
         return -1;
     }
-    // Find an invalid entry
-    int index = find_invalid_entry();
-    if (index == -1) {
-        // Cache is full, replace MRU entry
-        index = find_mru_entry();
-        if (index == -1) {
-            // Should not happen, but handle just in case
-            return -1;
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    int index = cache_index[key];
+    bool changed = true;
+    if (index != -1) {
+        // Rewriting a block with what it already holds leaves it clean
+        changed = s->partial[index] || !block_equal(entry_block(s, index), buf);
+        if (changed) {
+            block_copy(entry_block(s, index), buf);
+            s->partial[index] = 0;
         }
+        touch_entry(s, index);
+    } else {
+        index = insert_entry(s, key, buf);
     }
-    // Insert the new entry
-    cache[index].valid = true;
-    cache[index].disk_num = disk_num;
-    cache[index].block_num = block_num;
-    memcpy(cache[index].block, buf, JBOD_BLOCK_SIZE);
-    clock++;
-    cache[index].clock_accesses = clock;
+    if (index != -1 && changed) {
+        mark_dirty(s, index);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return index != -1 ? 1 : -1;
+}
+
+/* Sets the bits of bytes [|offset|, |offset| + |len|) in |mask| and returns
+ * true if that leaves every byte set. */
+static bool mask_set(block_mask_t *mask, uint32_t offset, uint32_t len) {
+    uint32_t end = offset + len;
+    for (uint32_t b = offset; b < end;) {
+        uint32_t n = end - b < 64 - b % 64 ? end - b : 64 - b % 64;
+        uint64_t bits = n == 64 ? ~0ull : (1ull << n) - 1;
+        mask->bits[b / 64] |= bits << (b % 64);
+        b += n;
+    }
+    uint64_t all = ~0ull;
+    for (int w = 0; w < JBOD_BLOCK_SIZE / 64; w++) {
+        all &= mask->bits[w];
+    }
+    return all == ~0ull;
+}
+
+int cache_write_partial(int disk_num, int block_num, uint32_t offset, uint32_t len,
+                        const uint8_t *buf) {
+    if (!cache_enabled() || writeback == NULL || fill == NULL || buf == NULL ||
+        !valid_location(disk_num, block_num) || len == 0 || offset >= JBOD_BLOCK_SIZE ||
+        len > JBOD_BLOCK_SIZE - offset) {
+        return -1;
+    }
+    int key = cache_key(disk_num, block_num);
+    cache_shard_t *s = lock_key(key);
+    int index = cache_index[key];
+    if (index != -1) {
+        touch_entry(s, index);
+    } else {
+        // Only the bytes written are copied in; the rest are never looked
+        // at until the entry is completed
+        index = insert_entry(s, key, NULL);
+        if (index != -1) {
+            memset(&s->valid[index], 0, sizeof(s->valid[index]));
+            s->partial[index] = 1;
+        }
+    }
+    if (index != -1) {
+        memcpy(entry_block(s, index) + offset, buf, len);
+        if (s->partial[index] && mask_set(&s->valid[index], offset, len)) {
+            s->partial[index] = 0;
+        }
+        mark_dirty(s, index);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return index != -1 ? 1 : -1;
+}
+
+int cache_set_fill(cache_fill_t fn) {
+    if (!cache_enabled()) {
+        return -1;
+    }
+    fill = fn;
     return 1;
 }
 
+int cache_flush(void) {
+    if (!cache_enabled()) {
+        return -1;
+    }
+    // Walk the index rather than the entries, so that blocks go back in
+    // (disk, block) order and the device sees a forward sweep
+    int rc = 1;
+    for (int key = 0; key < CACHE_NUM_KEYS; key++) {
+        cache_shard_t *s = lock_key(key);
+        if (cache_index[key] != -1 && clean_entry(s, cache_index[key]) != 0) {
+            rc = -1;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return rc;
+}
+
+int cache_flush_disk(int disk_num) {
+    if (!cache_enabled() || disk_num < 0 || disk_num >= JBOD_NUM_DISKS) {
+        return -1;
+    }
+    int rc = 1;
+    for (int block = 0; block < JBOD_NUM_BLOCKS_PER_DISK &&
+                        atomic_load_explicit(&disk_dirty[disk_num], memory_order_relaxed) > 0;
+         block++) {
+        int key = cache_key(disk_num, block);
+        cache_shard_t *s = lock_key(key);
+        if (cache_index[key] != -1 && clean_entry(s, cache_index[key]) != 0) {
+            rc = -1;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return rc;
+}
+
+int cache_set_write_back(cache_writeback_t fn) {
+    if (!cache_enabled()) {
+        return -1;
+    }
+    if (fn == NULL && cache_flush() != 1) {
+        return -1;
+    }
+    writeback = fn;
+    return 1;
+}
+
+int cache_set_admission(bool enable) {
+    if (!cache_enabled()) {
+        return -1;
+    }
+    int rc = 1;
+    for (int n = 0; n < num_shards; n++) {
+        cache_shard_t *s = &shards[n];
+        pthread_mutex_lock(&s->lock);
+        if (enable && sketch_reserve(s) != 0) {
+            rc = -1;
+        } else if (!enable) {
+            while (s->window.len > 0) {
+                window_promote(s);
+            }
+            free(s->sketch);
+            s->sketch = NULL;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (rc != 1) {
+        cache_set_admission(false);
+    }
+    return rc;
+}
+
+bool cache_admission_enabled(void) {
+    return cache_enabled() && shards[0].sketch != NULL;
+}
+
+bool cache_write_back_enabled(void) {
+    return cache_enabled() && writeback != NULL;
+}
+
 bool cache_enabled(void) {
-    return (cache != NULL && cache_size > 0);
+    return (shards != NULL && cache_size > 0);
+}
+
+int cache_num_shards(void) {
+    return num_shards;
+}
+
+cache_policy_t cache_policy(void) {
+    return policy_id;
+}
+
+const char *cache_policy_name(cache_policy_t p) {
+    if (p < 0 || p >= CACHE_NUM_POLICIES) {
+        return NULL;
+    }
+    return policies[p].name;
+}
+
+int cache_policy_parse(const char *name, cache_policy_t *p) {
+    for (int i = 0; i < CACHE_NUM_POLICIES; i++) {
+        if (strcasecmp(name, policies[i].name) == 0) {
+            *p = (cache_policy_t)i;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+    stats->policy = policy_id;
+    stats->num_entries = cache_size;
+    stats->num_shards = num_shards;
+    stats->queries = atomic_load(&num_queries);
+    stats->hits = atomic_load(&num_hits);
+    stats->misses = stats->queries - stats->hits;
+    stats->inserts = atomic_load(&num_inserts);
+    stats->evictions = atomic_load(&num_evictions);
+    stats->writebacks = atomic_load(&num_writebacks);
+    stats->rejections = atomic_load(&num_rejections);
+    stats->fills = atomic_load(&num_fills);
+}
+
+void cache_reset_stats(void) {
+    atomic_store(&num_queries, 0);
+    atomic_store(&num_hits, 0);
+    atomic_store(&num_inserts, 0);
+    atomic_store(&num_evictions, 0);
+    atomic_store(&num_writebacks, 0);
+    atomic_store(&num_rejections, 0);
+    atomic_store(&num_fills, 0);
 }
 
 void cache_print_hit_rate(void) {
-    fprintf(stderr, "num_hits: %d, num_queries: %d\n", num_hits, num_queries);
-    if (num_queries > 0) {
-        fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float)num_hits / num_queries);
+    int hits = atomic_load(&num_hits);
+    int queries = atomic_load(&num_queries);
+    fprintf(stderr, "num_hits: %d, num_queries: %d\n", hits, queries);
+    if (queries > 0) {
+        fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float)hits / queries);
     } else {
         fprintf(stderr, "Hit rate: N/A\n");
     }
 }
 
+/* Moves the resident entry |from| of |s| into the free slot |to|, keeping
+ * its place in its policy's queue. */
+static void move_entry(cache_shard_t *s, int from, int to) {
+    s->tags[to] = s->tags[from];
+    s->stamps[to] = s->stamps[from];
+    s->ref_bits[to] = s->ref_bits[from];
+    s->dirty[to] = s->dirty[from];
+    s->partial[to] = s->partial[from];
+    s->valid[to] = s->valid[from];
+    s->queue[to] = s->queue[from];
+    block_copy(entry_block(s, to), entry_block(s, from));
+    if (s->queue[from] != QUEUE_NONE) {
+        list_replace(resident_list(s, from), from, to);
+    }
+    cache_index[s->tags[to]] = to;
+    s->tags[from] = CACHE_NO_TAG;
+    s->queue[from] = QUEUE_NONE;
+}
+
+/* Returns 0 on success and -1 on failure. Shrinks |s| to |new_size|
+ * entries: evicts in the policy's own order until the remaining blocks fit,
+ * then moves the ones that live above |new_size| down into freed slots. If a
+ * dirty victim cannot be written back, the shard keeps its old size. */
+static int shrink_shard(cache_shard_t *s, int new_size) {
+    // The policy can only evict what it manages, so the window shrinks first
+    while (s->window.len > window_size(new_size)) {
+        window_promote(s);
+    }
+    int used = 0;
+    for (int i = 0; i < s->size; i++) {
+        used += s->tags[i] != CACHE_NO_TAG;
+    }
+    while (used > new_size) {
+        if (evict_entry(s) == -1) {
+            rebuild_free_list(s);
+            return -1;
+        }
+        used--;
+    }
+    int to = 0;
+    for (int from = new_size; from < s->size; from++) {
+        if (s->tags[from] == CACHE_NO_TAG) {
+            continue;
+        }
+        while (s->tags[to] != CACHE_NO_TAG) {
+            to++;
+        }
+        move_entry(s, from, to);
+    }
+    // The metadata arrays keep their room for when the shard grows again
+    resize_chunks(s, new_size);
+    return 0;
+}
+
+/* Returns 0 on success and -1 on failure. Resizes |s| to |new_size| entries,
+ * see cache_resize. */
+static int resize_shard(cache_shard_t *s, int new_size) {
+    if (new_size < s->size) {
+        if (shrink_shard(s, new_size) != 0) {
+            return -1;
+        }
+    } else if (new_size > s->size) {
+        // Growing only adds free slots; resident blocks stay where they are
+        if (reserve_metadata(s, new_size) != 0 || resize_chunks(s, new_size) != 0) {
+            resize_chunks(s, s->size);
+            return -1;
+        }
+        for (int i = s->size; i < new_size; i++) {
+            s->tags[i] = CACHE_NO_TAG;
+            s->queue[i] = QUEUE_NONE;
+            s->ref_bits[i] = 0;
+            s->dirty[i] = 0;
+            s->partial[i] = 0;
+        }
+    }
+    s->size = new_size;
+    if (policy->resize != NULL) {
+        policy->resize(s);
+    }
+    // A sketch that cannot be resized keeps working at its old width
+    if (s->sketch != NULL) {
+        sketch_reserve(s);
+    }
+    rebuild_free_list(s);
+    return 0;
+}
+
 int cache_resize(int new_size) {
-    if (new_size < 2 || new_size > 4096) {
+    if (new_size < 2 || new_size > CACHE_MAX_ENTRIES) {
         return -1;
     }
     if (!cache_enabled()) {
-        return cache_create(new_size);
+        return cache_create_with_policy(new_size, policy_id);
     }
-    // Allocate new cache
-    cache_entry_t *new_cache = (cache_entry_t *)malloc(sizeof(cache_entry_t) * new_size);
-    if (new_cache == NULL) {
+    if (new_size < 2 * num_shards) {
         return -1;
     }
-    // Initialize new cache entries
-    for (int i = 0; i < new_size; i++) {
-        new_cache[i].valid = false;
+    // Shards are resized one at a time, so a failure can leave the earlier
+    // ones at their new size; the total is recomputed either way
+    int rc = 1;
+    for (int n = 0; n < num_shards; n++) {
+        cache_shard_t *s = &shards[n];
+        pthread_mutex_lock(&s->lock);
+        if (resize_shard(s, shard_size(new_size, n)) != 0) {
+            rc = -1;
+        }
+        pthread_mutex_unlock(&s->lock);
     }
-    // Copy existing entries to new cache
-    int entries_to_copy = (new_size < cache_size) ? new_size : cache_size;
-    for (int i = 0; i < entries_to_copy; i++) {
-        new_cache[i] = cache[i];
+    cache_size = 0;
+    for (int n = 0; n < num_shards; n++) {
+        cache_size += shards[n].size;
     }
-    // Free old cache and update pointers
-    free(cache);
-    cache = new_cache;
-    cache_size = new_size;
-    return 1;
+    return rc;
+}
+
+/* A snapshot is this header followed by |num_records| records, coldest
+ * first, all in host byte order. Each record carries the SHA-1 of its block,
+ * which is what mdadm's block signatures are too. */
+#define CACHE_SNAPSHOT_MAGIC "MDCACHE1"
+
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t num_records;
+} cache_snapshot_header_t;
+
+typedef struct {
+    uint16_t key;
+    uint8_t sig[CACHE_SIG_SIZE];
+    uint8_t block[JBOD_BLOCK_SIZE];
+} cache_snapshot_record_t;
+
+/* A resident entry, as found by cache_save. */
+typedef struct {
+    int stamp;
+    int shard;
+    int index;
+} snapshot_entry_t;
+
+static int compare_stamps(const void *a, const void *b) {
+    const snapshot_entry_t *x = a, *y = b;
+    return (x->stamp > y->stamp) - (x->stamp < y->stamp);
+}
+
+int cache_save(const char *path) {
+    if (!cache_enabled() || path == NULL || cache_flush() != 1) {
+        return -1;
+    }
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return -1;
+    }
+    snapshot_entry_t *entries = malloc(sizeof(*entries) * cache_size);
+    cache_snapshot_record_t *records = malloc(sizeof(*records) * cache_size);
+    if (entries == NULL || records == NULL) {
+        free(entries);
+        free(records);
+        return -1;
+    }
+
+    // Every shard is held while it is copied out, so the snapshot is one
+    // consistent picture; hashing waits until they are released
+    int n = 0;
+    for (int i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+    }
+    for (int i = 0; i < num_shards; i++) {
+        cache_shard_t *s = &shards[i];
+        for (int j = 0; j < s->size; j++) {
+            // A partial entry written since the flush is not a whole block
+            if (s->tags[j] != CACHE_NO_TAG && !s->partial[j]) {
+                entries[n++] = (snapshot_entry_t){ s->stamps[j], i, j };
+            }
+        }
+    }
+    // Stamps are per shard, so across shards the order is only approximate
+    qsort(entries, n, sizeof(*entries), compare_stamps);
+    for (int i = 0; i < n; i++) {
+        cache_shard_t *s = &shards[entries[i].shard];
+        records[i].key = s->tags[entries[i].index];
+        block_copy(records[i].block, entry_block(s, entries[i].index));
+    }
+    for (int i = num_shards - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    for (int i = 0; i < n; i++) {
+        SHA1(records[i].block, JBOD_BLOCK_SIZE, records[i].sig);
+    }
+
+    // Written aside and renamed over |path|, so a crash never leaves a torn
+    // snapshot behind
+    cache_snapshot_header_t header = { .block_size = JBOD_BLOCK_SIZE, .num_records = n };
+    memcpy(header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    int rc = -1;
+    FILE *out = fopen(tmp_path, "w");
+    if (out != NULL) {
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       fwrite(records, sizeof(*records), n, out) == (size_t)n &&
+                       fflush(out) == 0 && fsync(fileno(out)) == 0;
+        if (fclose(out) == 0 && written && rename(tmp_path, path) == 0) {
+            rc = n;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    free(entries);
+    free(records);
+    return rc;
+}
+
+int cache_load(const char *path, cache_validate_t validate) {
+    struct stat st;
+    if (!cache_enabled() || path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(cache_snapshot_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    const cache_snapshot_header_t *header = map;
+    const cache_snapshot_record_t *records = (const cache_snapshot_record_t *)(header + 1);
+    if (memcmp(header->magic, CACHE_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->block_size != JBOD_BLOCK_SIZE ||
+        (size_t)st.st_size != sizeof(*header) + sizeof(*records) * header->num_records) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // Only the hottest blocks that fit are worth loading; inserting in
+    // snapshot order then rebuilds their recency from coldest to hottest
+    uint32_t first = 0;
+    if (header->num_records > (uint32_t)cache_size) {
+        first = header->num_records - cache_size;
+    }
+    int loaded = 0;
+    uint8_t sig[CACHE_SIG_SIZE];
+    for (uint32_t i = first; i < header->num_records; i++) {
+        const cache_snapshot_record_t *r = &records[i];
+        if (r->key >= CACHE_NUM_KEYS) {
+            continue;
+        }
+        // A block that was damaged in the file, or that no longer matches
+        // the device, would be served as if it were current
+        SHA1(r->block, JBOD_BLOCK_SIZE, sig);
+        if (memcmp(sig, r->sig, CACHE_SIG_SIZE) != 0 ||
+            (validate != NULL && !validate(key_disk(r->key), key_block(r->key), r->sig))) {
+            continue;
+        }
+        cache_shard_t *s = lock_key(r->key);
+        if (cache_index[r->key] == -1 && insert_entry(s, r->key, r->block) != -1) {
+            loaded++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    munmap(map, st.st_size);
+    return loaded;
 }
@@ -7,19 +7,39 @@
 #include "jbod.h"
 #include "util.h"
 
-typedef struct {
-  bool valid;
-  int disk_num;
-  int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
-  int clock_accesses;
-} cache_entry_t;
-
-/* Returns 1 on success and -1 on failure. Should allocate a space for
- * |num_entries| cache entries, each of type cache_entry_t. Calling it again
+/* Eviction policies a cache can be created with. */
+typedef enum {
+  CACHE_POLICY_MRU,    /* evict the most recently used entry */
+  CACHE_POLICY_LRU,    /* evict the least recently used entry */
+  CACHE_POLICY_CLOCK,  /* second-chance sweep over reference bits */
+  CACHE_POLICY_2Q,     /* FIFO probation queue plus LRU main queue */
+  CACHE_POLICY_ARC,    /* adaptive replacement cache */
+  CACHE_NUM_POLICIES,
+} cache_policy_t;
+
+/* Returns 1 on success and -1 on failure. Should allocate space for
+ * |num_entries| cache entries: compact tag and recency metadata plus the
+ * JBOD_BLOCK_SIZE payloads, which come 64 to a chunk from a pool backed by
+ * huge pages where the system allows it (see pool.h). Calling it again
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
+/* Same as cache_create, but evicts according to |policy| instead of MRU. */
+int cache_create_with_policy(int num_entries, cache_policy_t policy);
+
+/* Same as cache_create_with_policy, but splits the cache into |num_shards|
+ * shards by (disk, block) hash. Each shard has its own lock and runs |policy|
+ * over its own share of the entries, so concurrent accesses to different
+ * shards never wait for each other; the price is that eviction order is only
+ * exact within a shard. Every shard needs at least two entries. With one
+ * shard this is cache_create_with_policy.
+ *
+ * All cache functions are thread-safe, except that creating, destroying and
+ * switching the write-back mode or the admission filter must not race with
+ * other calls. The write-back handler is called with the victim's shard
+ * locked. */
+int cache_create_sharded(int num_entries, cache_policy_t policy, int num_shards);
+
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
  * cache_create function above. */
 int cache_destroy(void);
@@ -29,26 +49,168 @@ int cache_destroy(void);
  * block to |buf|, which must not be NULL. */
 int cache_lookup(int disk_num, int block_num, uint8_t *buf);
 
+/* Returns true if the block at |disk_num| and |block_num| is cached. Unlike
+ * cache_lookup it copies nothing, does not count as a query and does not
+ * change the entry's recency. */
+bool cache_contains(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 on failure. Copies the cached block at
+ * |disk_num| and |block_num| to |buf| like cache_lookup, but does not count
+ * a query or a hit, feed the admission filter or change the entry's recency.
+ * Fails for blocks that are not cached or only partly written. */
+int cache_probe(int disk_num, int block_num, uint8_t *buf);
+
 /* Returns 1 on success and -1 on failure. Inserts an entry for |disk_num| and
  * |block_num| into cache. Returns -1 if there is already an existing entry in the cache
- * with |disk_num| and |block_num|.If there cache is full, should evict most
- * recently used entry and insert the new entry. */
+ * with |disk_num| and |block_num|. If the cache is full, evicts the entry chosen
+ * by the cache's policy (the most recently used one by default) and inserts
+ * the new entry, unless that entry is dirty, in which case it fails rather
+ * than write the dirty block back. */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
 /* If the entry with |disk_num| and |block_num| exists, updates the
  * corresponding block with data from |buf| */
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Writes the block at |disk_num| and |block_num| from |buf| to the device.
+ * Returns 1 on success and -1 on failure. */
+typedef int (*cache_writeback_t)(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns 1 on success and -1 on failure. Switches the cache to write-back
+ * mode: cache_write keeps blocks dirty in the cache, and |writeback| is called
+ * to write a dirty block to the device when it is evicted or flushed. Passing
+ * NULL flushes the cache and switches back to write-through. The mode is reset
+ * by cache_destroy. */
+int cache_set_write_back(cache_writeback_t writeback);
+
+/* Returns 1 on success and -1 on failure. Turns the admission filter on or
+ * off. With it on, every cache_lookup is counted in a small frequency sketch
+ * (a count-min sketch whose counts are halved periodically), and each shard
+ * keeps an admission window of a fifth of its entries in front of the
+ * policy. cache_insert always puts the new block in the window, so it
+ * succeeds just as it would without the filter. Once the window is full, its
+ * oldest block is the candidate for the policy's part of the shard: it takes
+ * the place of the entry the policy would evict if it is estimated to be
+ * looked up more often, and is evicted itself otherwise, which counts as a
+ * rejection. This keeps one-off scans from flushing a hot working set. Blocks
+ * inserted by cache_write and cache_write_partial bypass the window. Turning
+ * the filter off hands the window's blocks to the policy. The filter is off
+ * until turned on, and reset by cache_destroy. */
+int cache_set_admission(bool enable);
+
+/* Returns true if the cache is enabled and filters admissions. */
+bool cache_admission_enabled(void);
+
+/* Returns true if the cache is enabled and in write-back mode. */
+bool cache_write_back_enabled(void);
+
+/* Returns 1 on success and -1 on failure. In write-back mode, stores |buf| as
+ * the new, dirty contents of the block at |disk_num| and |block_num|,
+ * inserting an entry if there is none. Fails when not in write-back mode, in
+ * which case the caller must write the block to the device itself. */
+int cache_write(int disk_num, int block_num, const uint8_t *buf);
+
+/* Reads the block at |disk_num| and |block_num| from the device into |buf|.
+ * Returns 1 on success and -1 on failure. */
+typedef int (*cache_fill_t)(int disk_num, int block_num, uint8_t *buf);
+
+/* Returns 1 on success and -1 on failure. Sets the function that completes
+ * blocks written only in part, see cache_write_partial; NULL turns partial
+ * writes off. Must not be cleared while partial blocks are cached, so switch
+ * write-back off first. Reset by cache_destroy. */
+int cache_set_fill(cache_fill_t fill);
+
+/* Returns 1 on success and -1 on failure. In write-back mode with a fill
+ * function set, stores the |len| bytes at |buf| at |offset| within the block
+ * at |disk_num| and |block_num|, without reading the rest of the block. A
+ * block that is not cached gets a dirty entry that remembers which bytes have
+ * been written; once they cover the block it is an ordinary dirty entry. The
+ * unwritten bytes are read from the device only when they are needed, by a
+ * cache_lookup or when the block is written back. Fails otherwise, in which
+ * case the caller must read, modify and write the block itself. */
+int cache_write_partial(int disk_num, int block_num, uint32_t offset, uint32_t len,
+                        const uint8_t *buf);
+
+/* Returns 1 on success and -1 on failure. Writes every dirty entry back to
+ * the device. */
+int cache_flush(void);
+
+/* Returns 1 on success and -1 on failure. Writes every dirty entry of disk
+ * |disk_num| back to the device, in block order. */
+int cache_flush_disk(int disk_num);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
+/* Returns the number of shards the cache was created with, 0 if disabled. */
+int cache_num_shards(void);
+
+/* Returns the policy the cache was created with. */
+cache_policy_t cache_policy(void);
+
+/* Returns the short name of |policy| ("mru", "lru", "clock", "2q", "arc"), or
+ * NULL if it is not a valid policy. */
+const char *cache_policy_name(cache_policy_t policy);
+
+/* Returns 1 and sets |policy| if |name| names a policy (case-insensitive),
+ * -1 otherwise. */
+int cache_policy_parse(const char *name, cache_policy_t *policy);
+
+/* Counters of a cache since it was created or the counters were reset. */
+typedef struct {
+  cache_policy_t policy;
+  int num_entries;
+  int num_shards;
+  int queries;     /* cache_lookup calls */
+  int hits;
+  int misses;
+  int inserts;     /* blocks that got an entry */
+  int evictions;   /* entries the policy gave up to make room or on shrinking */
+  int writebacks;  /* dirty entries written to the device */
+  int rejections;  /* blocks the admission filter kept out */
+  int fills;       /* partial blocks completed from the device */
+} cache_stats_t;
+
+/* Copies the cache's counters into |stats|. */
+void cache_get_stats(cache_stats_t *stats);
+
+/* Zeroes the cache's counters. */
+void cache_reset_stats(void);
+
 /* Prints the hit rate of the cache. */
 void cache_print_hit_rate(void);
 
 /* Resizes the cache to |new_size| entries. If |new_size| is smaller than the
- * current size, evicts the most recently used entries. If |new_size| is
- * larger than the current size, allocates new entries and initializes them to
- * invalid. */
+ * current size, evicts entries in the order the cache's policy would (the most
+ * recently used ones for MRU) until the rest fit. If |new_size| is larger than
+ * the current size, adds new invalid entries without moving resident blocks.
+ * A sharded cache spreads |new_size| over its shards, each of which keeps at
+ * least two entries. */
 int cache_resize(int new_size);
 
+/* Size of the block signatures in a snapshot (SHA-1, as mdadm's are). */
+#define CACHE_SIG_SIZE 20
+
+/* Returns true if the block at |disk_num| and |block_num| on the device
+ * still has the signature |sig|. */
+typedef bool (*cache_validate_t)(int disk_num, int block_num, const uint8_t *sig);
+
+/* Writes the resident blocks, coldest first, with a signature of each, to a
+ * snapshot at |path|, so that a restarted process can start with a warm
+ * cache. Dirty entries are written back first, so the snapshot matches the
+ * device. Returns the number of blocks saved, or -1 on failure, in which
+ * case any earlier snapshot at |path| is left as it was. */
+int cache_save(const char *path);
+
+/* Maps the snapshot at |path| and inserts its blocks into the cache, which
+ * must already be enabled, as clean entries in their saved recency order.
+ * Only the hottest blocks that fit are loaded; blocks already cached, blocks
+ * whose data no longer matches their signature and blocks |validate| (if not
+ * NULL) rejects are skipped. The signatures alone only catch damage to the
+ * file: with a NULL |validate| the file is trusted to match the device, and a
+ * block changed on the device since the save is loaded anyway. Use
+ * mdadm_load_cache to check against the device. Returns the number of blocks
+ * loaded, or -1 if the file is not a snapshot for this device. */
+int cache_load(const char *path, cache_validate_t validate);
+
 #endif
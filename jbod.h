@@ -15,11 +15,10 @@ typedef enum {
   JBOD_SEEK_TO_DISK            = 0x02,
   JBOD_SEEK_TO_BLOCK           = 0x03,
   JBOD_READ_BLOCK              = 0x04,
-  JBOD_WRITE_BLOCK             = 0x05, // Corrected value
-  JBOD_SIGN_BLOCK              = 0x06, // Corrected value
-  JBOD_RESERVED                = 0x07,
-  JBOD_WRITE_PERMISSION        = 0x08, // Corrected value
-  JBOD_REVOKE_WRITE_PERMISSION = 0x09, // Corrected value
+  JBOD_WRITE_PERMISSION        = 0x05,
+  JBOD_REVOKE_WRITE_PERMISSION = 0x06,
+  JBOD_WRITE_BLOCK             = 0x07,
+  JBOD_SIGN_BLOCK              = 0x08,
   JBOD_NUM_CMDS,
 } jbod_cmd_t;
 
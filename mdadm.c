@@ -1,16 +1,87 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
 
+#include "block.h"
 #include "cache.h"
 #include "jbod.h"
 #include "mdadm.h"
+#include "pool.h"
 
-static int mounted = 0;
-static bool write_permission = false;
+static atomic_int mounted = 0;
+static atomic_bool write_permission = false;
+
+// serializes everything sent to jbod_operation, so that a seek and the read
+// or write after it reach the device together. it is only ever held around
+// device operations, never while taking another lock.
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a request of at most MAX_IO_LEN bytes touches at most MAX_IO_PIECES
+// blocks, and so at most that many runs of blocks on one disk.
+#define MAX_IO_LEN 1024
+#define MAX_IO_PIECES (MAX_IO_LEN / JBOD_BLOCK_SIZE + 1)
+
+// per-call descriptor arrays (sorted segments, batch pieces) that fit in
+// SCRATCH_SIZE bytes come from a pool with per-thread free lists, so the
+// steady-state I/O path never calls malloc. bigger ones still do.
+#define SCRATCH_SIZE 16384
+
+static pool_t scratch_pool = POOL_INITIALIZER(SCRATCH_SIZE, 16 * SCRATCH_SIZE);
+
+static void *scratch_alloc(size_t size) {
+    return size <= SCRATCH_SIZE ? pool_get(&scratch_pool) : malloc(size);
+}
+
+static void scratch_free(void *p, size_t size) {
+    if (size <= SCRATCH_SIZE) {
+        pool_put(&scratch_pool, p);
+    } else {
+        free(p);
+    }
+}
+
+// the shape of the mounted volume, see mdadm_mount_geometry. it only changes
+// at mount time, which must not race with I/O. until then it is the whole
+// device.
+static block_geometry_t geometry = {
+    .num_disks = JBOD_NUM_DISKS,
+    .blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK,
+    .disk_size = JBOD_DISK_SIZE,
+    .size = (uint64_t)JBOD_NUM_DISKS * JBOD_DISK_SIZE,
+    .disk_shift = __builtin_ctz(JBOD_DISK_SIZE),
+    .stripe_shift = -1,
+    .disks_shift = __builtin_ctz(JBOD_NUM_DISKS),
+};
+
+// shadow copy of the JBOD head position, so redundant seeks can be skipped.
+// -1 means the position is unknown and the next access must seek. protected
+// by device_lock.
+static int head_disk = -1;
+static int head_block = -1;
+
+// one lock per block, held while a block is read from the device and put in
+// the cache, written to the device and the cache, or read, modified and
+// written back, so that the device and the cache always agree on its
+// contents. a thread holds at most one block lock at a time, and takes cache
+// and device locks only after it.
+#define NUM_KEYS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+static pthread_mutex_t block_locks[NUM_KEYS] = {
+    [0 ... NUM_KEYS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static inline pthread_mutex_t *block_lock(uint32_t disk_num, uint32_t block_num) {
+    return &block_locks[block_key(disk_num, block_num)];
+}
+
+// device writes mark their block's signature stale, see below.
+static atomic_bool sig_stale[NUM_KEYS];
 
 // helper function to encode JBOD operations into a single uint32_t.
 // combines the command, disk ID, and block ID.
@@ -18,43 +89,1050 @@ static uint32_t encode_op(uint8_t cmd, uint8_t disk_id, uint8_t block_id) {
     return (cmd << 12) | (block_id << 4) | disk_id;
 }
 
-int mdadm_mount(void) {
-    // check if already mounted
-    if (mounted) {
-        return -1; // do not mount if already mounted
+// statistics. counters are relaxed atomics: they are only ever added to and
+// read as a snapshot, which does not need to be consistent across counters.
+static atomic_ullong stat_jbod_ops[JBOD_NUM_CMDS];
+static atomic_ullong stat_jbod_errors;
+static atomic_ullong stat_seeks_avoided;
+static atomic_ullong stat_bytes_read;
+static atomic_ullong stat_bytes_written;
+static atomic_ullong stat_calls[MDADM_NUM_CALLS];
+static atomic_ullong stat_latency[MDADM_NUM_CALLS][MDADM_LATENCY_BUCKETS];
+
+static inline void stat_add(atomic_ullong *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// records a finished call of kind |call| that started at |start| and
+// returned |rc|, moving |rc| bytes if it is positive.
+static void stat_call(mdadm_call_t call, bool write, uint64_t start, int rc) {
+    uint64_t ns = now_ns() - start;
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= MDADM_LATENCY_BUCKETS) {
+        bucket = MDADM_LATENCY_BUCKETS - 1;
+    }
+    stat_add(&stat_calls[call], 1);
+    stat_add(&stat_latency[call][bucket], 1);
+    if (rc > 0) {
+        stat_add(write ? &stat_bytes_written : &stat_bytes_read, rc);
+    }
+}
+
+// helper function to send an operation to the device, counting it.
+static int jbod_op(uint8_t cmd, uint32_t op, uint8_t *block) {
+    stat_add(&stat_jbod_ops[cmd], 1);
+    int rc = jbod_operation(op, block);
+    if (rc != 0) {
+        stat_add(&stat_jbod_errors, 1);
+        log_warn("jbod operation 0x%05x failed: %s", op, jbod_error_string(jbod_error));
+    }
+    return rc;
+}
+
+// helper function to position the JBOD head at |disk_num|, |block_num|,
+// issuing only the seeks the current head position makes necessary.
+// returns 0 on success and -1 on failure.
+static int seek_to_block(uint32_t disk_num, uint32_t block_num) {
+    if (head_disk != (int)disk_num) {
+        if (jbod_op(JBOD_SEEK_TO_DISK, encode_op(JBOD_SEEK_TO_DISK, disk_num, 0), NULL) != 0) {
+            head_disk = -1;
+            return -1;
+        }
+        // seeking to a disk leaves the head at its first block
+        head_disk = disk_num;
+        head_block = 0;
+    } else {
+        stat_add(&stat_seeks_avoided, 1);
+    }
+    if (head_block != (int)block_num) {
+        if (jbod_op(JBOD_SEEK_TO_BLOCK, encode_op(JBOD_SEEK_TO_BLOCK, 0, block_num), NULL) != 0) {
+            head_disk = -1;
+            return -1;
+        }
+        head_block = block_num;
+    } else {
+        stat_add(&stat_seeks_avoided, 1);
+    }
+    return 0;
+}
+
+// helper function to read or write the block under the head.
+// JBOD advances the head to the next block afterwards, and so does the shadow.
+// returns 0 on success and -1 on failure.
+static int block_io(uint8_t cmd, uint8_t *block) {
+    if (jbod_op(cmd, encode_op(cmd, 0, 0), block) != 0) {
+        head_disk = -1;
+        return -1;
+    }
+    head_block++;
+    return 0;
+}
+
+// helper function to send a single non-I/O command to the device.
+// returns 0 on success and -1 on failure.
+static int device_command(uint8_t cmd) {
+    pthread_mutex_lock(&device_lock);
+    int rc = jbod_op(cmd, encode_op(cmd, 0, 0), NULL);
+    head_disk = head_block = -1;
+    pthread_mutex_unlock(&device_lock);
+    return rc == 0 ? 0 : -1;
+}
+
+// helper function to read or write block |disk_num|, |block_num| of the
+// device, seeking first as needed. returns 0 on success and -1 on failure.
+static int device_io(uint8_t cmd, uint32_t disk_num, uint32_t block_num, uint8_t *block) {
+    pthread_mutex_lock(&device_lock);
+    int rc = seek_to_block(disk_num, block_num);
+    if (rc == 0) {
+        rc = block_io(cmd, block);
+    }
+    // a failed write may still have changed the block
+    if (cmd == JBOD_WRITE_BLOCK) {
+        atomic_store(&sig_stale[block_key(disk_num, block_num)], true);
+    }
+    pthread_mutex_unlock(&device_lock);
+    return rc;
+}
+
+// sequential read-ahead. reads that continue where an earlier read left off
+// form a stream, and once a stream is seen the next |ra_window| blocks are
+// read into the cache while the head is already positioned after it. the
+// window adapts to how many of the prefetched blocks are actually read.
+#define RA_STREAMS 4          // streams tracked at once
+#define RA_INITIAL_WINDOW 4   // window of a newly enabled read-ahead
+#define RA_SAMPLE 64          // prefetched blocks between window adjustments
+
+typedef struct {
+    int disk_num;    // -1 if the slot is unused
+    int next_block;  // block right after the end of the last read
+} ra_stream_t;
+
+// the read-ahead state is protected by ra_lock, which is never held across
+// device I/O.
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t ra_max_window = 0;  // 0 disables read-ahead
+static uint32_t ra_window = 0;
+static ra_stream_t ra_streams[RA_STREAMS];
+static int ra_victim = 0;
+static uint32_t ra_issued = 0;  // prefetched blocks in the current sample
+static uint32_t ra_used = 0;    // ... and how many of them have been read
+// blocks that were prefetched and have not been read yet, by cache key
+static uint8_t ra_pending[JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK / 8];
+
+static inline int ra_key(uint32_t disk_num, uint32_t block_num) {
+    return block_key(disk_num, block_num);
+}
+
+static void ra_reset(void) {
+    for (int i = 0; i < RA_STREAMS; i++) {
+        ra_streams[i].disk_num = -1;
+    }
+    memset(ra_pending, 0, sizeof(ra_pending));
+    ra_window = ra_max_window < RA_INITIAL_WINDOW ? ra_max_window : RA_INITIAL_WINDOW;
+    ra_issued = ra_used = 0;
+}
+
+int mdadm_set_read_ahead(uint32_t max_blocks) {
+    if (max_blocks > JBOD_NUM_BLOCKS_PER_DISK) {
+        return -1;
+    }
+    pthread_mutex_lock(&ra_lock);
+    ra_max_window = max_blocks;
+    ra_reset();
+    pthread_mutex_unlock(&ra_lock);
+    return 1;
+}
+
+// doubles the window when most prefetched blocks get read and halves it when
+// few do, once every RA_SAMPLE prefetched blocks.
+static void ra_adapt(void) {
+    if (ra_issued < RA_SAMPLE) {
+        return;
+    }
+    if (ra_used * 4 >= ra_issued * 3) {
+        ra_window = ra_window * 2 > ra_max_window ? ra_max_window : ra_window * 2;
+    } else if (ra_used * 4 < ra_issued && ra_window > 1) {
+        ra_window /= 2;
+    }
+    ra_issued = ra_used = 0;
+}
+
+// records a demand read of block |disk_num|, |block_num|, crediting the
+// read-ahead if it prefetched the block.
+static void ra_note_read(uint32_t disk_num, uint32_t block_num) {
+    int key = ra_key(disk_num, block_num);
+    pthread_mutex_lock(&ra_lock);
+    if (ra_pending[key / 8] & (1 << (key % 8))) {
+        ra_pending[key / 8] &= ~(1 << (key % 8));
+        // a block evicted before it was read did not help
+        if (cache_contains(disk_num, block_num)) {
+            ra_used++;
+            ra_adapt();
+        }
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// returns the stream a read starting at |disk_num|, |block_num| continues, or
+// -1 if it starts a new one. starting inside the block the stream ended in
+// counts as continuing it.
+static int ra_find_stream(uint32_t disk_num, uint32_t block_num) {
+    for (int i = 0; i < RA_STREAMS; i++) {
+        if (ra_streams[i].disk_num == (int)disk_num &&
+            ((int)block_num == ra_streams[i].next_block ||
+             (int)block_num + 1 == ra_streams[i].next_block)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// reads up to |window| blocks past |last_block| into the cache. blocks the
+// cache already holds, typically from the previous window, are skipped, and
+// the prefetch stops at the first cached block after that so that it costs
+// at most one seek. it also stops at a block another thread is working on,
+// and errors only end the prefetch.
+static void ra_prefetch(uint32_t disk_num, uint32_t last_block, uint32_t window) {
+    uint32_t block_num = last_block + 1;
+    uint32_t end = last_block + 1 + window;
+    if (end > geometry.blocks_per_disk) {
+        end = geometry.blocks_per_disk;
+    }
+    while (block_num < end && cache_contains(disk_num, block_num)) {
+        block_num++;
+    }
+    uint8_t block[JBOD_BLOCK_SIZE];
+    for (; block_num < end; block_num++) {
+        pthread_mutex_t *lock = block_lock(disk_num, block_num);
+        if (pthread_mutex_trylock(lock) != 0) {
+            return;
+        }
+        int rc = -1;
+        if (!cache_contains(disk_num, block_num) &&
+            device_io(JBOD_READ_BLOCK, disk_num, block_num, block) == 0) {
+            rc = cache_insert(disk_num, block_num, block);
+        }
+        pthread_mutex_unlock(lock);
+        if (rc != 1) {
+            return;
+        }
+        int key = ra_key(disk_num, block_num);
+        pthread_mutex_lock(&ra_lock);
+        ra_pending[key / 8] |= 1 << (key % 8);
+        ra_issued++;
+        ra_adapt();
+        pthread_mutex_unlock(&ra_lock);
+    }
+}
+
+// updates the stream tracking after a read of |first_block| .. |last_block|
+// on |disk_num| and prefetches if the read continued a stream.
+static void ra_after_read(uint32_t disk_num, uint32_t first_block, uint32_t last_block) {
+    pthread_mutex_lock(&ra_lock);
+    int s = ra_find_stream(disk_num, first_block);
+    bool continues = s != -1;
+    if (!continues) {
+        s = ra_victim;
+        ra_victim = (ra_victim + 1) % RA_STREAMS;
+        ra_streams[s].disk_num = disk_num;
+    }
+    ra_streams[s].next_block = last_block + 1;
+    uint32_t window = ra_window;
+    pthread_mutex_unlock(&ra_lock);
+    if (continues) {
+        ra_prefetch(disk_num, last_block, window);
+    }
+}
+
+// content signatures. each block has a SHA-1 digest, each disk one over its
+// block digests and the volume one over the disk digests. device writes mark
+// their block stale, and an update rehashes only the stale blocks and the
+// disks they are on. updates are serialized by sig_update_lock; sig_lock
+// guards the digests, which readers copy out.
+#define SIG_MAX_THREADS 64
+#define SIG_MIN_BLOCKS_PER_THREAD 64
+#define LOAD_SIG_THREADS 4
+
+static pthread_mutex_t sig_update_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sig_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t sig_blocks[NUM_KEYS][MDADM_SIG_SIZE];
+static uint8_t sig_disks[JBOD_NUM_DISKS][MDADM_SIG_SIZE];
+static uint8_t sig_volume[MDADM_SIG_SIZE];
+static bool sig_valid = false;
+
+// the blocks one hashing thread digests.
+typedef struct {
+    const uint8_t *data;
+    uint8_t (*digests)[MDADM_SIG_SIZE];
+    uint32_t count;
+} sig_job_t;
+
+// nothing is known about the contents of a newly mounted volume.
+static void sig_reset(void) {
+    pthread_mutex_lock(&sig_lock);
+    sig_valid = false;
+    pthread_mutex_unlock(&sig_lock);
+    for (uint32_t k = 0; k < NUM_KEYS; k++) {
+        bool in_volume = key_disk(k) < geometry.num_disks && key_block(k) < geometry.blocks_per_disk;
+        atomic_store(&sig_stale[k], in_volume);
+    }
+}
+
+static void *sig_hash(void *arg) {
+    sig_job_t *job = arg;
+    for (uint32_t i = 0; i < job->count; i++) {
+        SHA1(job->data + (size_t)i * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, job->digests[i]);
+    }
+    return NULL;
+}
+
+// reads the current contents of block |key| into |dst|, from the cache if it
+// is there. the cache is only probed, so that refreshing signatures does not
+// count as lookups or reorder the cache. returns 0 on success and -1 on
+// failure.
+static int sig_read_block(uint32_t key, uint8_t *dst) {
+    uint32_t disk_num = key_disk(key);
+    uint32_t block_num = key_block(key);
+    pthread_mutex_t *lock = block_lock(disk_num, block_num);
+
+    pthread_mutex_lock(lock);
+    // cleared before the read, so that a write after it marks the block again
+    atomic_store(&sig_stale[key], false);
+    int rc = 0;
+    if (!cache_enabled() || cache_probe(disk_num, block_num, dst) != 1) {
+        rc = device_io(JBOD_READ_BLOCK, disk_num, block_num, dst);
+    }
+    if (rc != 0) {
+        atomic_store(&sig_stale[key], true);
+    }
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+int mdadm_update_signatures(int num_threads) {
+    if (!mounted || num_threads < 1) {
+        return -1;
+    }
+    if (num_threads > SIG_MAX_THREADS) {
+        num_threads = SIG_MAX_THREADS;
+    }
+    // signatures describe the device, so dirty blocks go first
+    if (mdadm_flush() != 1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&sig_update_lock);
+    uint32_t *keys = malloc(sizeof(*keys) * NUM_KEYS);
+    uint32_t count = 0;
+    for (uint32_t k = 0; keys && k < NUM_KEYS; k++) {
+        if (atomic_load(&sig_stale[k])) {
+            keys[count++] = k;
+        }
+    }
+    uint8_t *data = malloc((size_t)count * JBOD_BLOCK_SIZE + 1);
+    uint8_t (*digests)[MDADM_SIG_SIZE] = malloc(sizeof(*digests) * count + 1);
+    int rc = keys && data && digests ? (int)count : -1;
+
+    // stale blocks come in (disk, block) order, so the reads mostly follow
+    // the head. hashing is what is spread over the threads.
+    for (uint32_t i = 0; rc != -1 && i < count; i++) {
+        if (sig_read_block(keys[i], data + (size_t)i * JBOD_BLOCK_SIZE) != 0) {
+            // the blocks not reread are still stale
+            for (uint32_t j = i + 1; j < count; j++) {
+                atomic_store(&sig_stale[keys[j]], true);
+            }
+            rc = -1;
+        }
+    }
+
+    if (rc != -1) {
+        uint32_t threads = (count + SIG_MIN_BLOCKS_PER_THREAD - 1) / SIG_MIN_BLOCKS_PER_THREAD;
+        if (threads > (uint32_t)num_threads) {
+            threads = num_threads;
+        }
+        sig_job_t jobs[SIG_MAX_THREADS];
+        pthread_t tids[SIG_MAX_THREADS];
+        uint32_t started = 0, first = 0;
+        for (uint32_t t = 0; t < threads; t++) {
+            uint32_t n = count / threads + (t < count % threads);
+            jobs[t] = (sig_job_t){ data + (size_t)first * JBOD_BLOCK_SIZE, digests + first, n };
+            first += n;
+        }
+        // the calling thread takes the first share itself
+        for (uint32_t t = 1; t < threads; t++) {
+            if (pthread_create(&tids[t], NULL, sig_hash, &jobs[t]) != 0) {
+                break;
+            }
+            started = t;
+        }
+        for (uint32_t t = started + 1; t < threads; t++) {
+            sig_hash(&jobs[t]);
+        }
+        if (threads > 0) {
+            sig_hash(&jobs[0]);
+        }
+        for (uint32_t t = 1; t <= started; t++) {
+            pthread_join(tids[t], NULL);
+        }
+
+        bool touched[JBOD_NUM_DISKS] = { false };
+        pthread_mutex_lock(&sig_lock);
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(sig_blocks[keys[i]], digests[i], MDADM_SIG_SIZE);
+            touched[key_disk(keys[i])] = true;
+        }
+        for (uint32_t d = 0; d < geometry.num_disks; d++) {
+            if (touched[d]) {
+                SHA1(sig_blocks[block_key(d, 0)],
+                     (size_t)geometry.blocks_per_disk * MDADM_SIG_SIZE, sig_disks[d]);
+            }
+        }
+        if (count > 0) {
+            SHA1(sig_disks[0], (size_t)geometry.num_disks * MDADM_SIG_SIZE, sig_volume);
+        }
+        sig_valid = true;
+        pthread_mutex_unlock(&sig_lock);
+    }
+    pthread_mutex_unlock(&sig_update_lock);
+    free(keys);
+    free(data);
+    free(digests);
+    return rc;
+}
+
+// copies |src| to |sig| if the signatures have been brought up to date since
+// the device was mounted. returns 1 on success and -1 on failure.
+static int sig_copy(uint8_t *sig, const uint8_t *src) {
+    pthread_mutex_lock(&sig_lock);
+    bool valid = sig_valid;
+    if (valid) {
+        memcpy(sig, src, MDADM_SIG_SIZE);
+    }
+    pthread_mutex_unlock(&sig_lock);
+    return valid ? 1 : -1;
+}
+
+int mdadm_block_signature(uint32_t disk_num, uint32_t block_num, uint8_t *sig) {
+    if (disk_num >= geometry.num_disks || block_num >= geometry.blocks_per_disk || !sig) {
+        return -1;
+    }
+    return sig_copy(sig, sig_blocks[block_key(disk_num, block_num)]);
+}
+
+int mdadm_disk_signature(uint32_t disk_num, uint8_t *sig) {
+    if (disk_num >= geometry.num_disks || !sig) {
+        return -1;
+    }
+    return sig_copy(sig, sig_disks[disk_num]);
+}
+
+int mdadm_volume_signature(uint8_t *sig) {
+    if (!sig) {
+        return -1;
+    }
+    return sig_copy(sig, sig_volume);
+}
+
+_Static_assert(CACHE_SIG_SIZE == MDADM_SIG_SIZE, "snapshots must carry mdadm's signatures");
+
+// validator for cache_load: a saved block is current if its signature is the
+// one the volume's block had at the last update.
+static bool sig_matches(int disk_num, int block_num, const uint8_t *sig) {
+    uint8_t current[MDADM_SIG_SIZE];
+    return mdadm_block_signature(disk_num, block_num, current) == 1 &&
+           memcmp(current, sig, MDADM_SIG_SIZE) == 0;
+}
+
+int mdadm_load_cache(const char *path) {
+    if (!mounted || !cache_enabled()) {
+        return -1;
+    }
+    if (mdadm_update_signatures(LOAD_SIG_THREADS) == -1) {
+        return -1;
+    }
+    return cache_load(path, sig_matches);
+}
+
+int mdadm_mount_geometry(const mdadm_geometry_t *g) {
+    // check if already mounted
+    if (mounted || g == NULL) {
+        return -1; // do not mount if already mounted
+    }
+    // the volume has to fit on the device, and stripes have to tile it
+    if (g->block_size != JBOD_BLOCK_SIZE || g->num_disks == 0 ||
+        g->num_disks > JBOD_NUM_DISKS || g->blocks_per_disk == 0 ||
+        g->blocks_per_disk > JBOD_NUM_BLOCKS_PER_DISK ||
+        (g->stripe_blocks != 0 && g->blocks_per_disk % g->stripe_blocks != 0)) {
+        return -1;
+    }
+    // attempt to mount
+    if (device_command(JBOD_MOUNT) == 0) {
+        block_geometry_init(&geometry, g->num_disks, g->blocks_per_disk, g->stripe_blocks);
+        mounted = 1;
+        log_info("mdadm: mounted");
+        ra_reset();
+        sig_reset();
+        return 1; // mount successful
+    }
+    return -1; // mount failed
+}
+
+int mdadm_mount(void) {
+    mdadm_geometry_t g = { JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK, JBOD_BLOCK_SIZE, 0 };
+    return mdadm_mount_geometry(&g);
+}
+
+void mdadm_get_geometry(mdadm_geometry_t *g) {
+    g->num_disks = geometry.num_disks;
+    g->blocks_per_disk = geometry.blocks_per_disk;
+    g->block_size = JBOD_BLOCK_SIZE;
+    g->stripe_blocks = geometry.stripe_blocks;
+}
+
+int mdadm_unmount(void) {
+    // check mounting status
+    if (!mounted) {
+        return -1; // can't unmount if not mounted
+    }
+    // dirty cached blocks must reach the device first
+    if (mdadm_flush() != 1) {
+        return -1;
+    }
+    // attempt to unmount
+    if (device_command(JBOD_UNMOUNT) == 0) {
+        mounted = 0;
+        log_info("mdadm: unmounted");
+        return 1; // unmount successful
+    }
+    return -1; // unmount failed
+}
+
+// in write-back mode, writes the dirty cached blocks of the disk under the
+// head back before each device read, so that they go out while the head is
+// near them, the way write-through would have written them, rather than on
+// eviction from wherever the head has got to by then. blocks that cannot be
+// written stay dirty for their eviction to retry.
+static void flush_head_disk(void) {
+    pthread_mutex_lock(&device_lock);
+    int disk_num = head_disk;
+    pthread_mutex_unlock(&device_lock);
+    if (disk_num >= 0) {
+        cache_flush_disk(disk_num);
+    }
+}
+
+// reads block |disk_num|, |block_num| into |dst|, from the cache when
+// possible and otherwise from the device, filling the cache on the way.
+// the caller holds the block's lock. returns 0 on success and -1 on failure.
+static int fetch_block(uint32_t disk_num, uint32_t block_num, uint8_t *dst) {
+    if (cache_enabled() && cache_lookup(disk_num, block_num, dst) == 1) {
+        return 0;
+    }
+    if (cache_write_back_enabled()) {
+        flush_head_disk();
+    }
+    if (device_io(JBOD_READ_BLOCK, disk_num, block_num, dst) != 0) {
+        return -1;
+    }
+    if (cache_enabled()) {
+        cache_insert(disk_num, block_num, dst);
+    }
+    return 0;
+}
+
+// writes |src| to block |disk_num|, |block_num|. in write-back mode it only
+// goes to the cache, otherwise to the device and the cache is kept coherent
+// with it. the caller holds the block's lock. returns 0 on success and -1 on
+// failure.
+static int store_block(uint32_t disk_num, uint32_t block_num, const uint8_t *src) {
+    if (cache_write_back_enabled() && cache_write(disk_num, block_num, src) == 1) {
+        return 0;
+    }
+    // JBOD_WRITE_BLOCK only reads from the buffer
+    if (device_io(JBOD_WRITE_BLOCK, disk_num, block_num, (uint8_t *)src) != 0) {
+        return -1;
+    }
+    if (cache_enabled() && cache_insert(disk_num, block_num, src) != 1) {
+        cache_update(disk_num, block_num, src);
+    }
+    return 0;
+}
+
+// write-back handler for the cache: writes a dirty block to the device. the
+// cache serializes it with every other access to the block through the
+// block's shard lock. returns 1 on success and -1 on failure.
+static int write_back_block(int disk_num, int block_num, const uint8_t *buf) {
+    if (!mounted) {
+        return -1;
+    }
+    if (device_io(JBOD_WRITE_BLOCK, disk_num, block_num, (uint8_t *)buf) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// fill handler for the cache: reads the current contents of a block that
+// was only written in part, so the cache can complete it. like
+// write_back_block it runs under the block's shard lock. returns 1 on success
+// and -1 on failure.
+static int fill_block(int disk_num, int block_num, uint8_t *buf) {
+    if (!mounted) {
+        return -1;
+    }
+    if (device_io(JBOD_READ_BLOCK, disk_num, block_num, buf) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+int mdadm_set_write_back(bool enable) {
+    if (!enable) {
+        // the flush may still have partial blocks to complete
+        if (cache_set_write_back(NULL) != 1) {
+            return -1;
+        }
+        cache_set_fill(NULL);
+        return 1;
+    }
+    if (cache_set_fill(fill_block) != 1) {
+        return -1;
+    }
+    return cache_set_write_back(write_back_block);
+}
+
+int mdadm_flush(void) {
+    if (!mounted) {
+        return -1;
+    }
+    if (!cache_write_back_enabled()) {
+        return 1;
+    }
+    return cache_flush();
+}
+
+// the block a read or write range is currently working on. a vectored call
+// keeps it across segments, so several segments that touch the same block
+// cost one device read and one device write between them. a write keeps the
+// block locked from the read until the write of its new contents; a read
+// only locks it while fetching.
+typedef struct {
+    int disk_num;   // -1 if the buffer holds no block
+    int block_num;
+    bool dirty;     // data has not been written back yet
+    bool locked;    // the block's lock is held
+    uint8_t data[JBOD_BLOCK_SIZE];
+} block_buffer_t;
+
+static void block_buffer_init(block_buffer_t *bb) {
+    bb->disk_num = -1;
+    bb->block_num = -1;
+    bb->dirty = false;
+    bb->locked = false;
+}
+
+// releases the buffered block's lock, keeping its data.
+static void block_buffer_unlock(block_buffer_t *bb) {
+    if (bb->locked) {
+        pthread_mutex_unlock(block_lock(bb->disk_num, bb->block_num));
+        bb->locked = false;
+    }
+}
+
+static inline bool block_buffer_holds(const block_buffer_t *bb, uint32_t disk_num,
+                                      uint32_t block_num) {
+    return bb->disk_num == (int)disk_num && bb->block_num == (int)block_num;
+}
+
+// writes a dirty buffered block to the device, keeping the cache coherent
+// with it, and releases the block's lock either way.
+// returns 0 on success and -1 on failure.
+static int block_buffer_flush(block_buffer_t *bb) {
+    int rc = 0;
+    if (bb->dirty) {
+        rc = store_block(bb->disk_num, bb->block_num, bb->data);
+        bb->dirty = false;
+    }
+    block_buffer_unlock(bb);
+    return rc;
+}
+
+// makes |bb| hold |disk_num|, |block_num| with the block locked. if
+// |need_data| is set, the buffer gets the current contents of the block via
+// fetch_block. returns 0 on success and -1 on failure.
+static int block_buffer_load(block_buffer_t *bb, uint32_t disk_num, uint32_t block_num,
+                             bool need_data) {
+    if (block_buffer_holds(bb, disk_num, block_num)) {
+        return 0;
+    }
+    if (block_buffer_flush(bb) != 0) {
+        return -1;
+    }
+    bb->disk_num = -1;
+    pthread_mutex_lock(block_lock(disk_num, block_num));
+    if (need_data && fetch_block(disk_num, block_num, bb->data) != 0) {
+        pthread_mutex_unlock(block_lock(disk_num, block_num));
+        return -1;
+    }
+    bb->disk_num = disk_num;
+    bb->block_num = block_num;
+    bb->locked = true;
+    return 0;
+}
+
+// reads |read_len| bytes at |start_addr| into |read_buf|. the range must
+// already have been validated. returns 0 on success and -1 on failure.
+static int read_range(block_buffer_t *bb, uint32_t start_addr, uint32_t read_len,
+                      uint8_t *read_buf) {
+    uint32_t bytes_read = 0;
+    bool read_ahead = ra_max_window > 0 && cache_enabled() && read_len > 0;
+
+    // loop until all the bytes are read
+    while (bytes_read < read_len) {
+        uint32_t addr = start_addr + bytes_read;
+        uint32_t disk_num, block_num;
+        addr_locate(&geometry, addr, &disk_num, &block_num);
+        uint32_t offset_in_block = addr_offset(addr);
+
+        // how many bytes can be read from the current block
+        uint32_t bytes_left_in_block = JBOD_BLOCK_SIZE - offset_in_block;
+        uint32_t bytes_to_read = read_len - bytes_read;
+        if (bytes_to_read > bytes_left_in_block) {
+            bytes_to_read = bytes_left_in_block;
+        }
+
+        if (read_ahead) {
+            ra_note_read(disk_num, block_num);
+        }
+
+        if (bytes_to_read == JBOD_BLOCK_SIZE && !block_buffer_holds(bb, disk_num, block_num)) {
+            // a whole aligned block goes straight into the caller's buffer
+            pthread_mutex_lock(block_lock(disk_num, block_num));
+            int rc = fetch_block(disk_num, block_num, read_buf + bytes_read);
+            pthread_mutex_unlock(block_lock(disk_num, block_num));
+            if (rc != 0) {
+                return -1;
+            }
+        } else {
+            // partial blocks go through the block buffer, which is served
+            // from the cache when possible
+            if (block_buffer_load(bb, disk_num, block_num, true) != 0) {
+                return -1;
+            }
+
+            // copy the data from block to buffer
+            memcpy(read_buf + bytes_read, bb->data + offset_in_block, bytes_to_read);
+            block_buffer_unlock(bb);
+        }
+
+        // update total bytes read
+        bytes_read += bytes_to_read;
+    }
+
+    if (read_ahead) {
+        // a stream stays on one disk, so a read that crosses into the next
+        // disk or stripe unit is tracked from where it ends
+        uint32_t last_addr = start_addr + read_len - 1;
+        uint32_t run_start = addr_run_start(&geometry, last_addr);
+        uint32_t first_addr = start_addr > run_start ? start_addr : run_start;
+        uint32_t last_disk, last_block;
+        addr_locate(&geometry, last_addr, &last_disk, &last_block);
+        ra_after_read(last_disk, addr_block(&geometry, first_addr), last_block);
+    }
+
+    return 0;
+}
+
+// writes |write_len| bytes from |write_buf| at |start_addr|. the range must
+// already have been validated. the last block touched stays dirty in |bb|
+// until the caller flushes it. returns 0 on success and -1 on failure.
+static int write_range(block_buffer_t *bb, uint32_t start_addr, uint32_t write_len,
+                       const uint8_t *write_buf) {
+    uint32_t bytes_written = 0;
+
+    while (bytes_written < write_len) {
+        // Calculate current position
+        uint32_t curr_addr = start_addr + bytes_written;
+        uint32_t disk_num, block_num;
+        addr_locate(&geometry, curr_addr, &disk_num, &block_num);
+        uint32_t offset_in_block = addr_offset(curr_addr);
+
+        // Calculate how many bytes we can write in this block
+        uint32_t bytes_left_in_block = JBOD_BLOCK_SIZE - offset_in_block;
+        uint32_t bytes_to_write = write_len - bytes_written;
+        if (bytes_to_write > bytes_left_in_block) {
+            bytes_to_write = bytes_left_in_block;
+        }
+
+        if (bytes_to_write == JBOD_BLOCK_SIZE) {
+            // A whole aligned block is written straight from the caller's
+            // buffer. It supersedes any buffered copy of the same block, and
+            // any other dirty block is written first to keep the head moving
+            // forward.
+            if (block_buffer_holds(bb, disk_num, block_num)) {
+                block_buffer_unlock(bb);
+                block_buffer_init(bb);
+            } else if (block_buffer_flush(bb) != 0) {
+                return -1;
+            }
+            pthread_mutex_lock(block_lock(disk_num, block_num));
+            int rc = store_block(disk_num, block_num, write_buf + bytes_written);
+            pthread_mutex_unlock(block_lock(disk_num, block_num));
+            if (rc != 0) {
+                return -1;
+            }
+        } else {
+            // In write-back mode the cache takes just the bytes written and
+            // reads the rest of the block only if something needs it
+            bool cached = false;
+            if (cache_write_back_enabled() && !block_buffer_holds(bb, disk_num, block_num)) {
+                if (block_buffer_flush(bb) != 0) {
+                    return -1;
+                }
+                block_buffer_init(bb);
+                pthread_mutex_lock(block_lock(disk_num, block_num));
+                cached = cache_write_partial(disk_num, block_num, offset_in_block, bytes_to_write,
+                                             write_buf + bytes_written) == 1;
+                pthread_mutex_unlock(block_lock(disk_num, block_num));
+            }
+
+            if (!cached) {
+                // Otherwise a partial block needs the current contents
+                // first, from the cache if it has them
+                if (block_buffer_load(bb, disk_num, block_num, true) != 0) {
+                    return -1;
+                }
+
+                // Copy new data into the block buffer at the correct offset
+                memcpy(bb->data + offset_in_block, write_buf + bytes_written, bytes_to_write);
+                bb->dirty = true;
+            }
+        }
+
+        bytes_written += bytes_to_write;
+    }
+
+    return 0;
+}
+
+// reads or writes |len| bytes at |addr| in the calling thread. the range must
+// already have been validated. returns 0 on success and -1 on failure.
+static int run_range(bool write, uint32_t addr, uint32_t len, uint8_t *buf) {
+    block_buffer_t bb;
+    block_buffer_init(&bb);
+    if (write) {
+        if (write_range(&bb, addr, len, buf) != 0 || block_buffer_flush(&bb) != 0) {
+            return -1;
+        }
+        return 0;
+    }
+    return read_range(&bb, addr, len, buf);
+}
+
+// per-disk I/O queues. each disk has a submission queue and a worker thread
+// that services it in order, so that a request spanning several disks is
+// split into one sub-request per disk and the pieces run concurrently. the
+// JBOD has a single head, so the device operations themselves still take
+// turns on device_lock; what runs in parallel is everything around them,
+// cache hits in particular.
+
+// the sub-requests of one call, which completes when the last one does.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;  // sub-requests not finished yet
+    int rc;       // 0, or -1 if any sub-request failed
+} io_group_t;
+
+typedef struct io_request {
+    struct io_request *next;
+    bool write;
+    uint32_t addr;
+    uint32_t len;
+    uint8_t *buf;
+    io_group_t *group;
+} io_request_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    io_request_t *head;  // oldest request
+    io_request_t *tail;
+    bool stop;           // the worker exits once the queue is empty
+    pthread_t worker;
+} disk_queue_t;
+
+static disk_queue_t disk_queues[JBOD_NUM_DISKS];
+static bool io_workers_running = false;
+
+static void io_group_finish(io_group_t *group, int rc) {
+    pthread_mutex_lock(&group->lock);
+    if (rc != 0) {
+        group->rc = -1;
+    }
+    if (--group->pending == 0) {
+        pthread_cond_signal(&group->done);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+static void *io_worker(void *arg) {
+    disk_queue_t *q = arg;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head == NULL && !q->stop) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        io_request_t *req = q->head;
+        if (req == NULL) {
+            // stopping, and the queue is drained
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        q->head = req->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        io_group_finish(req->group, run_range(req->write, req->addr, req->len, req->buf));
     }
-    // mount operation
-    uint32_t op = encode_op(JBOD_MOUNT, 0, 0);
-    // attempt to mount
-    if (jbod_operation(op, NULL) == 0) {
-        mounted = 1;
-        return 1; // mount successful
+}
+
+static void io_enqueue(int disk_num, io_request_t *req) {
+    disk_queue_t *q = &disk_queues[disk_num];
+    req->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL) {
+        q->tail->next = req;
+    } else {
+        q->head = req;
     }
-    return -1; // mount failed
+    q->tail = req;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
 }
 
-int mdadm_unmount(void) {
-    // check mounting status
-    if (!mounted) {
-        return -1; // can't unmount if not mounted
+// stops and joins the first |count| workers after they drain their queues.
+static void io_stop_workers(int count) {
+    for (int d = 0; d < count; d++) {
+        pthread_mutex_lock(&disk_queues[d].lock);
+        disk_queues[d].stop = true;
+        pthread_cond_signal(&disk_queues[d].ready);
+        pthread_mutex_unlock(&disk_queues[d].lock);
     }
-    // unmount operation
-    uint32_t op = encode_op(JBOD_UNMOUNT, 0, 0);
-    // attempt to unmount
-    if (jbod_operation(op, NULL) == 0) {
-        mounted = 0;
-        return 1; // unmount successful
+    for (int d = 0; d < count; d++) {
+        pthread_join(disk_queues[d].worker, NULL);
+        pthread_cond_destroy(&disk_queues[d].ready);
+        pthread_mutex_destroy(&disk_queues[d].lock);
     }
-    return -1; // unmount failed
 }
 
-int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf) {
+int mdadm_set_io_queues(bool enable) {
+    if (enable == io_workers_running) {
+        return 1;
+    }
+    if (!enable) {
+        io_stop_workers(JBOD_NUM_DISKS);
+        io_workers_running = false;
+        return 1;
+    }
+    for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+        disk_queue_t *q = &disk_queues[d];
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->ready, NULL);
+        q->head = q->tail = NULL;
+        q->stop = false;
+        if (pthread_create(&q->worker, NULL, io_worker, q) != 0) {
+            pthread_cond_destroy(&q->ready);
+            pthread_mutex_destroy(&q->lock);
+            log_error("mdadm: cannot start the I/O worker of disk %d", d);
+            io_stop_workers(d);
+            return -1;
+        }
+    }
+    io_workers_running = true;
+    return 1;
+}
+
+// queues one sub-request in |reqs| per run of blocks on one disk that the
+// validated range of |len| bytes at |addr| touches, all completing |group|,
+// which must be initialized.
+static void io_group_submit(io_group_t *group, io_request_t *reqs, bool write, uint32_t addr,
+                            uint32_t len, uint8_t *buf) {
+    group->rc = 0;
+    if (len == 0) {
+        group->pending = 0;
+        return;
+    }
+    // every sub-request has to be counted before the first can complete
+    int n = 0;
+    for (uint64_t start = addr; start < (uint64_t)addr + len; n++) {
+        uint64_t end = addr_run_end(&geometry, start);
+        io_request_t *req = &reqs[n];
+        req->write = write;
+        req->addr = start;
+        req->len = (end < (uint64_t)addr + len ? end : (uint64_t)addr + len) - start;
+        req->buf = buf + (start - addr);
+        req->group = group;
+        start += req->len;
+    }
+    group->pending = n;
+    for (int i = 0; i < n; i++) {
+        io_enqueue(addr_disk(&geometry, reqs[i].addr), &reqs[i]);
+    }
+}
+
+// waits for every sub-request of |group|. returns 0 if they all succeeded
+// and -1 otherwise.
+static int io_group_wait(io_group_t *group) {
+    pthread_mutex_lock(&group->lock);
+    while (group->pending > 0) {
+        pthread_cond_wait(&group->done, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+    return group->rc;
+}
+
+// reads or writes |len| bytes at |addr| through the disk queues, one
+// sub-request per disk the range touches, and waits for all of them. the
+// range must already have been validated. returns 0 on success and -1 on
+// failure.
+static int queued_range(bool write, uint32_t addr, uint32_t len, uint8_t *buf) {
+    io_request_t reqs[MAX_IO_PIECES];
+    io_group_t group;
+    pthread_mutex_init(&group.lock, NULL);
+    pthread_cond_init(&group.done, NULL);
+    io_group_submit(&group, reqs, write, addr, len, buf);
+    int rc = io_group_wait(&group);
+    pthread_cond_destroy(&group.done);
+    pthread_mutex_destroy(&group.lock);
+    return rc;
+}
+
+// runs a validated range through the disk queues if they are enabled and in
+// the calling thread otherwise. returns 0 on success and -1 on failure.
+static int do_range(bool write, uint32_t addr, uint32_t len, uint8_t *buf) {
+    if (io_workers_running) {
+        return queued_range(write, addr, len, buf);
+    }
+    return run_range(write, addr, len, buf);
+}
+
+// checks the arguments of a read. returns 0 if it may go ahead and the
+// mdadm_read error code otherwise.
+static int check_read(uint32_t start_addr, uint32_t read_len, const uint8_t *read_buf) {
     // mount check
     if (!mounted) {
         return -3; 
     }
     // read_len within maximum check
-    if (read_len > 1024) {
+    if (read_len > MAX_IO_LEN) {
         return -2; 
     }
     // check buffer is not NULL
@@ -62,68 +1140,58 @@ int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf) {
         return -4; 
     }
     // check valid address range
-    uint32_t max_addr = JBOD_NUM_DISKS * JBOD_DISK_SIZE;
+    uint64_t max_addr = geometry.size;
     if (start_addr + read_len > max_addr || start_addr + read_len < start_addr) {
         return -1;
     }
+    return 0;
+}
 
-    uint32_t bytes_read = 0;
-
-    // loop until all the bytes are read
-    while (bytes_read < read_len) {
-        uint32_t addr = start_addr + bytes_read;
-        uint32_t disk_num = addr / JBOD_DISK_SIZE;
-        uint32_t addr_in_disk = addr % JBOD_DISK_SIZE;
-        uint32_t block_num = addr_in_disk / JBOD_BLOCK_SIZE;
-        uint32_t offset_in_block = addr_in_disk % JBOD_BLOCK_SIZE;
-
-        // how many bytes can be read from the current block
-        uint32_t bytes_left_in_block = JBOD_BLOCK_SIZE - offset_in_block;
-        uint32_t bytes_to_read = read_len - bytes_read;
-        if (bytes_to_read > bytes_left_in_block) {
-            bytes_to_read = bytes_left_in_block;
-        }
-
-        // move to the correct disk
-        uint32_t op = encode_op(JBOD_SEEK_TO_DISK, disk_num & 0x0F, 0);
-        if (jbod_operation(op, NULL) != 0) {
-            return -4;
-        }
-
-        // move to the correct block
-        op = encode_op(JBOD_SEEK_TO_BLOCK, 0, block_num & 0xFF);
-        if (jbod_operation(op, NULL) != 0) {
-            return -4;
-        }
-
-        // read block data
-        uint8_t block[JBOD_BLOCK_SIZE];
-        op = encode_op(JBOD_READ_BLOCK, 0, 0);
-        if (jbod_operation(op, block) != 0) {
-            return -4; 
-        }
-
-        // copy the data from block to buffer
-        memcpy(read_buf + bytes_read, block + offset_in_block, bytes_to_read);
+static int read_call(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf) {
+    int rc = check_read(start_addr, read_len, read_buf);
+    if (rc != 0) {
+        return rc;
+    }
 
-        // update total bytes read
-        bytes_read += bytes_to_read;
+    if (do_range(false, start_addr, read_len, read_buf) != 0) {
+        return -4;
     }
 
-    return bytes_read;
+    return read_len;
+}
+
+int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf) {
+    uint64_t start = now_ns();
+    int rc = read_call(start_addr, read_len, read_buf);
+    stat_call(MDADM_CALL_READ, false, start, rc);
+    return rc;
 }
 
 int mdadm_write_permission(void) {
+    // ask the device for write permission
+    if (device_command(JBOD_WRITE_PERMISSION) != 0) {
+        return -1;
+    }
     write_permission = true;
     return 0;
 }
 
 int mdadm_revoke_write_permission(void) {
+    // dirty cached blocks can only be written while we hold permission
+    if (mounted && mdadm_flush() != 1) {
+        return -1;
+    }
+    // hand write permission back to the device
+    if (device_command(JBOD_REVOKE_WRITE_PERMISSION) != 0) {
+        return -1;
+    }
     write_permission = false;
     return 0;
 }
 
-int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
+// checks the arguments of a write. returns 0 if it may go ahead, including
+// an empty write, and the mdadm_write error code otherwise.
+static int check_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
     // Check if system is mounted
     if (!mounted) {
         return -3;
@@ -135,7 +1203,7 @@ int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_bu
     }
 
     // Check write length
-    if (write_len > 1024) {
+    if (write_len > MAX_IO_LEN) {
         return -2;
     }
 
@@ -150,63 +1218,617 @@ int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_bu
     }
 
     // Check address bounds
-    uint32_t max_addr = JBOD_NUM_DISKS * JBOD_DISK_SIZE;
+    uint64_t max_addr = geometry.size;
     if (start_addr + write_len > max_addr || start_addr + write_len < start_addr) {
         return -1;
     }
+    return 0;
+}
+
+static int write_call(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
+    int rc = check_write(start_addr, write_len, write_buf);
+    if (rc != 0 || write_len == 0) {
+        return rc;
+    }
 
-    uint32_t bytes_written = 0;
-    
-    while (bytes_written < write_len) {
-        // Calculate current position
-        uint32_t curr_addr = start_addr + bytes_written;
-        uint32_t disk_num = curr_addr / JBOD_DISK_SIZE;
-        uint32_t addr_in_disk = curr_addr % JBOD_DISK_SIZE;
-        uint32_t block_num = addr_in_disk / JBOD_BLOCK_SIZE;
-        uint32_t offset_in_block = addr_in_disk % JBOD_BLOCK_SIZE;
+    // a write only reads from the buffer
+    if (do_range(true, start_addr, write_len, (uint8_t *)write_buf) != 0) {
+        return -4;
+    }
 
-        // Calculate how many bytes we can write in this block
-        uint32_t bytes_left_in_block = JBOD_BLOCK_SIZE - offset_in_block;
-        uint32_t bytes_to_write = write_len - bytes_written;
-        if (bytes_to_write > bytes_left_in_block) {
-            bytes_to_write = bytes_left_in_block;
+    return write_len;
+}
+
+int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
+    uint64_t start = now_ns();
+    int rc = write_call(start_addr, write_len, write_buf);
+    stat_call(MDADM_CALL_WRITE, true, start, rc);
+    return rc;
+}
+
+// asynchronous I/O. each submitted request takes a slot until it is reaped
+// by mdadm_poll or mdadm_wait; there are |async_depth| slots. a ticket names
+// a slot and the generation it was handed out in, so that a stale ticket is
+// told apart from the slot's next request.
+#define ASYNC_DEFAULT_DEPTH 64
+#define ASYNC_MAX_DEPTH 4096
+
+typedef struct {
+    io_group_t group;
+    io_request_t reqs[MAX_IO_PIECES];
+    int len;        // returned on success
+    bool busy;      // handed out and not reaped yet
+    uint32_t gen;
+} async_op_t;
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static async_op_t *async_ops = NULL;
+static int async_depth = ASYNC_DEFAULT_DEPTH;
+static int async_in_flight = 0;
+
+static inline int async_ticket(int slot) {
+    return (int)((async_ops[slot].gen % (INT32_MAX / ASYNC_MAX_DEPTH)) * ASYNC_MAX_DEPTH + slot);
+}
+
+// returns the slot |ticket| names, or NULL if it names none. called with
+// async_lock held.
+static async_op_t *async_find(int ticket) {
+    if (ticket < 0 || async_ops == NULL || ticket % ASYNC_MAX_DEPTH >= async_depth) {
+        return NULL;
+    }
+    int slot = ticket % ASYNC_MAX_DEPTH;
+    if (!async_ops[slot].busy || async_ticket(slot) != ticket) {
+        return NULL;
+    }
+    return &async_ops[slot];
+}
+
+// allocates the slot table if needed. called with async_lock held.
+// returns 0 on success and -1 on failure.
+static int async_alloc(void) {
+    if (async_ops != NULL) {
+        return 0;
+    }
+    async_ops = calloc(async_depth, sizeof(*async_ops));
+    if (async_ops == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < async_depth; i++) {
+        pthread_mutex_init(&async_ops[i].group.lock, NULL);
+        pthread_cond_init(&async_ops[i].group.done, NULL);
+    }
+    return 0;
+}
+
+static void async_free(void) {
+    for (int i = 0; async_ops != NULL && i < async_depth; i++) {
+        pthread_cond_destroy(&async_ops[i].group.done);
+        pthread_mutex_destroy(&async_ops[i].group.lock);
+    }
+    free(async_ops);
+    async_ops = NULL;
+}
+
+int mdadm_set_queue_depth(int depth) {
+    if (depth < 1 || depth > ASYNC_MAX_DEPTH) {
+        return -1;
+    }
+    pthread_mutex_lock(&async_lock);
+    if (async_in_flight > 0) {
+        pthread_mutex_unlock(&async_lock);
+        return -1;
+    }
+    async_free();
+    async_depth = depth;
+    pthread_mutex_unlock(&async_lock);
+    return 1;
+}
+
+// queues a request whose arguments have been checked. returns its ticket,
+// -6 if every slot is taken, or -4 if the disk queues are not running.
+static int async_submit(bool write, uint32_t addr, uint32_t len, uint8_t *buf) {
+    if (!io_workers_running) {
+        return -4;
+    }
+    pthread_mutex_lock(&async_lock);
+    if (async_alloc() != 0 || async_in_flight == async_depth) {
+        pthread_mutex_unlock(&async_lock);
+        return async_ops == NULL ? -4 : -6;
+    }
+    int slot = 0;
+    while (async_ops[slot].busy) {
+        slot++;
+    }
+    async_op_t *op = &async_ops[slot];
+    op->busy = true;
+    op->gen++;
+    op->len = len;
+    async_in_flight++;
+    int ticket = async_ticket(slot);
+    // the group's own lock orders the workers' completion against the reap
+    pthread_mutex_lock(&op->group.lock);
+    io_group_submit(&op->group, op->reqs, write, addr, len, buf);
+    pthread_mutex_unlock(&op->group.lock);
+    pthread_mutex_unlock(&async_lock);
+    return ticket;
+}
+
+int mdadm_submit_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+    int rc = check_read(addr, len, buf);
+    if (rc != 0) {
+        return rc;
+    }
+    return async_submit(false, addr, len, buf);
+}
+
+int mdadm_submit_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+    int rc = check_write(addr, len, buf);
+    if (rc != 0) {
+        return rc;
+    }
+    // a write only reads from the buffer
+    return async_submit(true, addr, len, (uint8_t *)buf);
+}
+
+// releases the finished request in |op| and returns what the synchronous
+// call would have. called with async_lock held.
+static int async_reap(async_op_t *op) {
+    op->busy = false;
+    async_in_flight--;
+    return op->group.rc == 0 ? op->len : -4;
+}
+
+int mdadm_poll(int ticket, int *result) {
+    pthread_mutex_lock(&async_lock);
+    async_op_t *op = async_find(ticket);
+    if (op == NULL || result == NULL) {
+        pthread_mutex_unlock(&async_lock);
+        return -1;
+    }
+    pthread_mutex_lock(&op->group.lock);
+    bool done = op->group.pending == 0;
+    pthread_mutex_unlock(&op->group.lock);
+    if (done) {
+        *result = async_reap(op);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return done ? 1 : 0;
+}
+
+int mdadm_wait(int ticket) {
+    pthread_mutex_lock(&async_lock);
+    async_op_t *op = async_find(ticket);
+    pthread_mutex_unlock(&async_lock);
+    if (op == NULL) {
+        return -4;
+    }
+    // the slot cannot be reused until it is reaped, and only the holder of
+    // the ticket reaps it
+    io_group_wait(&op->group);
+    pthread_mutex_lock(&async_lock);
+    int rc = async_reap(op);
+    pthread_mutex_unlock(&async_lock);
+    return rc;
+}
+
+// validates a segment list for a vectored call: every segment must have a
+// buffer unless it is empty, lie within the linear address space, and the
+// total must fit in the return value. returns 0 if the list is valid and
+// the mdadm_read/mdadm_write error code otherwise.
+static int validate_iov(const mdadm_iovec_t *iov, int iovcnt) {
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+        return -4;
+    }
+    uint64_t max_addr = geometry.size;
+    uint64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len > 0 && iov[i].buf == NULL) {
+            return -4;
+        }
+        if ((uint64_t)iov[i].addr + iov[i].len > max_addr) {
+            return -1;
+        }
+        total += iov[i].len;
+    }
+    if (total > INT32_MAX) {
+        return -2;
+    }
+    return 0;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    const mdadm_iovec_t *x = *(const mdadm_iovec_t *const *)a;
+    const mdadm_iovec_t *y = *(const mdadm_iovec_t *const *)b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    // keep equal addresses in submission order
+    return x < y ? -1 : (x > y);
+}
+
+// where |addr| is on the device: its disk, then its block on that disk, then
+// its byte within the block.
+static inline uint64_t device_position(uint32_t addr) {
+    uint32_t disk_num, block_num;
+    addr_locate(&geometry, addr, &disk_num, &block_num);
+    return ((uint64_t)block_key(disk_num, block_num) << JBOD_BLOCK_SHIFT) | addr_offset(addr);
+}
+
+static int compare_positions(const void *a, const void *b) {
+    const mdadm_iovec_t *x = *(const mdadm_iovec_t *const *)a;
+    const mdadm_iovec_t *y = *(const mdadm_iovec_t *const *)b;
+    uint64_t px = device_position(x->addr), py = device_position(y->addr);
+    if (px != py) {
+        return px < py ? -1 : 1;
+    }
+    return x < y ? -1 : (x > y);
+}
+
+// returns an array of pointers to the segments of |iov| sorted by the
+// physical position of their first byte, the way the batch path ranks its
+// pieces. in the striped layout consecutive addresses rotate across the
+// disks, so address order is not device order. if |keep_overlaps_ordered| is
+// set and two segments overlap, the submission order is kept instead, so that
+// the later segment wins as it would with separate calls. returns NULL if out
+// of memory; the array goes back with free_segments.
+static const mdadm_iovec_t **sort_segments(const mdadm_iovec_t *iov, int iovcnt,
+                                           bool keep_overlaps_ordered) {
+    const mdadm_iovec_t **order = scratch_alloc(sizeof(*order) * (iovcnt > 0 ? iovcnt : 1));
+    if (order == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        order[i] = &iov[i];
+    }
+    if (keep_overlaps_ordered) {
+        // overlaps show up between neighbours in address order
+        qsort(order, iovcnt, sizeof(*order), compare_segments);
+        uint64_t end = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            if (order[i]->len == 0) {
+                continue;
+            }
+            if (end > order[i]->addr) {
+                for (int j = 0; j < iovcnt; j++) {
+                    order[j] = &iov[j];
+                }
+                return order;
+            }
+            end = (uint64_t)order[i]->addr + order[i]->len;
         }
+    }
+    qsort(order, iovcnt, sizeof(*order), compare_positions);
+    return order;
+}
+
+static void free_segments(const mdadm_iovec_t **order, int iovcnt) {
+    scratch_free(order, sizeof(*order) * (iovcnt > 0 ? iovcnt : 1));
+}
+
+static int readv_call(const mdadm_iovec_t *iov, int iovcnt) {
+    if (!mounted) {
+        return -3;
+    }
+    int rc = validate_iov(iov, iovcnt);
+    if (rc != 0) {
+        return rc;
+    }
 
-        // Seek to correct disk
-        uint32_t op = encode_op(JBOD_SEEK_TO_DISK, disk_num, 0);
-        if (jbod_operation(op, NULL) != 0) {
+    const mdadm_iovec_t **order = sort_segments(iov, iovcnt, false);
+    if (order == NULL) {
+        return -4;
+    }
+
+    uint32_t total = 0;
+    block_buffer_t bb;
+    block_buffer_init(&bb);
+    for (int i = 0; i < iovcnt; i++) {
+        if (read_range(&bb, order[i]->addr, order[i]->len, order[i]->buf) != 0) {
+            free_segments(order, iovcnt);
             return -4;
         }
+        total += order[i]->len;
+    }
+
+    free_segments(order, iovcnt);
+    return total;
+}
+
+int mdadm_readv(const mdadm_iovec_t *iov, int iovcnt) {
+    uint64_t start = now_ns();
+    int rc = readv_call(iov, iovcnt);
+    stat_call(MDADM_CALL_READV, false, start, rc);
+    return rc;
+}
+
+static int writev_call(const mdadm_iovec_t *iov, int iovcnt) {
+    if (!mounted) {
+        return -3;
+    }
+    if (!write_permission) {
+        return -5;
+    }
+    int rc = validate_iov(iov, iovcnt);
+    if (rc != 0) {
+        return rc;
+    }
 
-        // Seek to correct block
-        op = encode_op(JBOD_SEEK_TO_BLOCK, 0, block_num);
-        if (jbod_operation(op, NULL) != 0) {
+    const mdadm_iovec_t **order = sort_segments(iov, iovcnt, true);
+    if (order == NULL) {
+        return -4;
+    }
+
+    uint32_t total = 0;
+    block_buffer_t bb;
+    block_buffer_init(&bb);
+    for (int i = 0; i < iovcnt; i++) {
+        if (write_range(&bb, order[i]->addr, order[i]->len, order[i]->buf) != 0) {
+            free_segments(order, iovcnt);
             return -4;
         }
+        total += order[i]->len;
+    }
+    free_segments(order, iovcnt);
+
+    if (block_buffer_flush(&bb) != 0) {
+        return -4;
+    }
+    return total;
+}
+
+int mdadm_writev(const mdadm_iovec_t *iov, int iovcnt) {
+    uint64_t start = now_ns();
+    int rc = writev_call(iov, iovcnt);
+    stat_call(MDADM_CALL_WRITEV, true, start, rc);
+    return rc;
+}
+
+
+// one block's share of a batch operation.
+typedef struct {
+    int rank;         // position of the block in the sweep
+    int op;           // index of the operation in the batch
+    bool write;
+    uint32_t disk_num;
+    uint32_t block_num;
+    uint32_t offset;  // first byte within the block
+    uint32_t len;
+    uint8_t *buf;     // the operation's bytes for this piece
+} batch_piece_t;
+
+static int compare_pieces(const void *a, const void *b) {
+    const batch_piece_t *x = a;
+    const batch_piece_t *y = b;
+    if (x->rank != y->rank) {
+        return x->rank < y->rank ? -1 : 1;
+    }
+    // within a block, the batch order decides
+    return x->op < y->op ? -1 : (x->op > y->op);
+}
+
+// services the pieces of one block, |pieces|[0 .. |count|), in batch order on
+// a private copy of the block. the block is read at most once, and not at all
+// if the first piece overwrites all of it, and written at most once, with its
+// final contents, so writes that later ones cover never reach the device. in
+// write-back mode, pieces that all write go to the cache as they are, without
+// reading the block. returns 0 on success and -1 on failure.
+static int run_block_pieces(const batch_piece_t *pieces, int count) {
+    uint32_t disk_num = pieces[0].disk_num;
+    uint32_t block_num = pieces[0].block_num;
+    uint8_t block[JBOD_BLOCK_SIZE];
+    bool written = false;
+    int rc = 0;
+
+    pthread_mutex_lock(block_lock(disk_num, block_num));
+    int writes = 0;
+    while (writes < count && pieces[writes].write) {
+        writes++;
+    }
+    if (writes == count && pieces[0].len < JBOD_BLOCK_SIZE && cache_write_back_enabled()) {
+        // if the cache gives up part way, the pieces are applied again below,
+        // which ends the same way
+        int i = 0;
+        while (i < count && cache_write_partial(disk_num, block_num, pieces[i].offset,
+                                                pieces[i].len, pieces[i].buf) == 1) {
+            i++;
+        }
+        if (i == count) {
+            pthread_mutex_unlock(block_lock(disk_num, block_num));
+            return 0;
+        }
+    }
+    if (!pieces[0].write || pieces[0].len < JBOD_BLOCK_SIZE) {
+        rc = fetch_block(disk_num, block_num, block);
+    }
+    for (int i = 0; rc == 0 && i < count; i++) {
+        const batch_piece_t *p = &pieces[i];
+        if (p->write) {
+            memcpy(block + p->offset, p->buf, p->len);
+            written = true;
+        } else {
+            memcpy(p->buf, block + p->offset, p->len);
+        }
+    }
+    if (rc == 0 && written) {
+        rc = store_block(disk_num, block_num, block);
+    }
+    pthread_mutex_unlock(block_lock(disk_num, block_num));
+    return rc;
+}
+
+static int batch_call(const mdadm_batch_op_t *ops, int nops) {
+    if (nops < 0 || (nops > 0 && ops == NULL)) {
+        return -4;
+    }
+    // every operation is checked before any I/O is issued
+    uint64_t total = 0;
+    int npieces = 0;
+    for (int i = 0; i < nops; i++) {
+        int rc = ops[i].write ? check_write(ops[i].addr, ops[i].len, ops[i].buf)
+                              : check_read(ops[i].addr, ops[i].len, ops[i].buf);
+        if (rc != 0) {
+            return rc;
+        }
+        if (ops[i].len > 0) {
+            npieces += ((ops[i].addr + ops[i].len - 1) >> JBOD_BLOCK_SHIFT) -
+                       (ops[i].addr >> JBOD_BLOCK_SHIFT) + 1;
+        }
+        total += ops[i].len;
+    }
+    if (total > INT32_MAX) {
+        return -2;
+    }
+
+    size_t pieces_size = sizeof(batch_piece_t) * (npieces > 0 ? npieces : 1);
+    batch_piece_t *pieces = scratch_alloc(pieces_size);
+    if (pieces == NULL) {
+        return -4;
+    }
 
-        // Create a temporary block buffer
-        uint8_t block[JBOD_BLOCK_SIZE] = {0};
+    // C-LOOK: sweep upwards from the block under the head, then wrap around
+    // to the lowest block and continue upwards
+    pthread_mutex_lock(&device_lock);
+    int start = head_disk >= 0 && head_block >= 0 && head_block < JBOD_NUM_BLOCKS_PER_DISK
+                    ? (int)block_key(head_disk, head_block) : 0;
+    pthread_mutex_unlock(&device_lock);
 
-        // If we're not writing a full block or not aligned to block boundary,
-        // we need to read the block first
-        if (bytes_to_write < JBOD_BLOCK_SIZE || offset_in_block != 0) {
-            op = encode_op(JBOD_READ_BLOCK, 0, 0);
-            if (jbod_operation(op, block) != 0) {
-                return -4;
+    int n = 0;
+    for (int i = 0; i < nops; i++) {
+        uint32_t done = 0;
+        while (done < ops[i].len) {
+            uint32_t addr = ops[i].addr + done;
+            batch_piece_t *p = &pieces[n++];
+            addr_locate(&geometry, addr, &p->disk_num, &p->block_num);
+            uint32_t key = block_key(p->disk_num, p->block_num);
+            p->rank = (key + NUM_KEYS - start) % NUM_KEYS;
+            p->op = i;
+            p->write = ops[i].write;
+            p->offset = addr_offset(addr);
+            p->len = JBOD_BLOCK_SIZE - p->offset;
+            if (p->len > ops[i].len - done) {
+                p->len = ops[i].len - done;
             }
+            p->buf = (uint8_t *)ops[i].buf + done;
+            done += p->len;
         }
+    }
+    qsort(pieces, n, sizeof(*pieces), compare_pieces);
 
-        // Copy new data into the block buffer at the correct offset
-        memcpy(block + offset_in_block, write_buf + bytes_written, bytes_to_write);
+    int rc = 0;
+    for (int first = 0; first < n && rc == 0;) {
+        int last = first + 1;
+        while (last < n && pieces[last].rank == pieces[first].rank) {
+            last++;
+        }
+        rc = run_block_pieces(&pieces[first], last - first);
+        first = last;
+    }
+    scratch_free(pieces, pieces_size);
+    return rc == 0 ? (int)total : -4;
+}
 
-        // Write the modified block back
-        op = encode_op(JBOD_WRITE_BLOCK, 0, 0);
-        if (jbod_operation(op, block) != 0) {
-            return -4;
+int mdadm_run_batch(const mdadm_batch_op_t *ops, int nops) {
+    uint64_t start = now_ns();
+    int rc = batch_call(ops, nops);
+    stat_call(MDADM_CALL_BATCH, false, start, 0);
+    if (rc > 0) {
+        for (int i = 0; i < nops; i++) {
+            stat_add(ops[i].write ? &stat_bytes_written : &stat_bytes_read, ops[i].len);
+        }
+    }
+    return rc;
+}
+
+void mdadm_get_stats(mdadm_stats_t *stats) {
+    for (int c = 0; c < JBOD_NUM_CMDS; c++) {
+        stats->jbod_ops[c] = atomic_load(&stat_jbod_ops[c]);
+    }
+    stats->jbod_errors = atomic_load(&stat_jbod_errors);
+    stats->seeks_avoided = atomic_load(&stat_seeks_avoided);
+    stats->bytes_read = atomic_load(&stat_bytes_read);
+    stats->bytes_written = atomic_load(&stat_bytes_written);
+    for (int c = 0; c < MDADM_NUM_CALLS; c++) {
+        stats->calls[c] = atomic_load(&stat_calls[c]);
+        for (int b = 0; b < MDADM_LATENCY_BUCKETS; b++) {
+            stats->latency[c][b] = atomic_load(&stat_latency[c][b]);
         }
+    }
+    cache_get_stats(&stats->cache);
+}
 
-        bytes_written += bytes_to_write;
+void mdadm_reset_stats(void) {
+    for (int c = 0; c < JBOD_NUM_CMDS; c++) {
+        atomic_store(&stat_jbod_ops[c], 0);
+    }
+    atomic_store(&stat_jbod_errors, 0);
+    atomic_store(&stat_seeks_avoided, 0);
+    atomic_store(&stat_bytes_read, 0);
+    atomic_store(&stat_bytes_written, 0);
+    for (int c = 0; c < MDADM_NUM_CALLS; c++) {
+        atomic_store(&stat_calls[c], 0);
+        for (int b = 0; b < MDADM_LATENCY_BUCKETS; b++) {
+            atomic_store(&stat_latency[c][b], 0);
+        }
     }
+    cache_reset_stats();
+}
+
+static const char *const jbod_cmd_names[JBOD_NUM_CMDS] = {
+    [JBOD_MOUNT] = "mount",
+    [JBOD_UNMOUNT] = "unmount",
+    [JBOD_SEEK_TO_DISK] = "seek_to_disk",
+    [JBOD_SEEK_TO_BLOCK] = "seek_to_block",
+    [JBOD_READ_BLOCK] = "read_block",
+    [JBOD_WRITE_PERMISSION] = "write_permission",
+    [JBOD_REVOKE_WRITE_PERMISSION] = "revoke_write_permission",
+    [JBOD_WRITE_BLOCK] = "write_block",
+    [JBOD_SIGN_BLOCK] = "sign_block",
+};
+
+static const char *const mdadm_call_names[MDADM_NUM_CALLS] = {
+    [MDADM_CALL_READ] = "read",
+    [MDADM_CALL_WRITE] = "write",
+    [MDADM_CALL_READV] = "readv",
+    [MDADM_CALL_WRITEV] = "writev",
+    [MDADM_CALL_BATCH] = "batch",
+};
+
+int mdadm_dump_stats(FILE *f) {
+    mdadm_stats_t st;
+    mdadm_get_stats(&st);
 
-    return bytes_written;
+    uint64_t device_ops = 0;
+    for (int c = 0; c < JBOD_NUM_CMDS; c++) {
+        fprintf(f, "jbod.%s %llu\n", jbod_cmd_names[c], (unsigned long long)st.jbod_ops[c]);
+        device_ops += st.jbod_ops[c];
+    }
+    fprintf(f, "jbod.errors %llu\n", (unsigned long long)st.jbod_errors);
+    fprintf(f, "mdadm.seeks_avoided %llu\n", (unsigned long long)st.seeks_avoided);
+    fprintf(f, "mdadm.bytes_read %llu\n", (unsigned long long)st.bytes_read);
+    fprintf(f, "mdadm.bytes_written %llu\n", (unsigned long long)st.bytes_written);
+    uint64_t bytes = st.bytes_read + st.bytes_written;
+    fprintf(f, "mdadm.device_ops_per_kib %.3f\n", bytes ? 1024.0 * device_ops / bytes : 0.0);
+    for (int c = 0; c < MDADM_NUM_CALLS; c++) {
+        fprintf(f, "call.%s.count %llu\n", mdadm_call_names[c], (unsigned long long)st.calls[c]);
+        // bucket b counts calls that took [2^(b-1), 2^b) ns; only non-empty
+        // buckets are listed, by their upper bound
+        for (int b = 0; b < MDADM_LATENCY_BUCKETS; b++) {
+            if (st.latency[c][b] > 0) {
+                fprintf(f, "call.%s.latency_lt_%lluns %llu\n", mdadm_call_names[c],
+                        1ull << b, (unsigned long long)st.latency[c][b]);
+            }
+        }
+    }
+    fprintf(f, "cache.policy %s\n", cache_policy_name(st.cache.policy));
+    fprintf(f, "cache.entries %d\n", st.cache.num_entries);
+    fprintf(f, "cache.shards %d\n", st.cache.num_shards);
+    fprintf(f, "cache.queries %d\n", st.cache.queries);
+    fprintf(f, "cache.hits %d\n", st.cache.hits);
+    fprintf(f, "cache.misses %d\n", st.cache.misses);
+    fprintf(f, "cache.inserts %d\n", st.cache.inserts);
+    fprintf(f, "cache.evictions %d\n", st.cache.evictions);
+    fprintf(f, "cache.writebacks %d\n", st.cache.writebacks);
+    fprintf(f, "cache.rejections %d\n", st.cache.rejections);
+    fprintf(f, "cache.fills %d\n", st.cache.fills);
+    return ferror(f) ? -1 : 1;
 }
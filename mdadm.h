@@ -2,12 +2,45 @@
 #define MDADM_H_
 
 #include <stdint.h>
+#include <stdio.h>
 #include "jbod.h"
 #include "cache.h"
 
-/* Return 1 on success and -1 on failure */
+/* mdadm_read, mdadm_write, their vectored versions and mdadm_flush may be
+ * called from several threads at once; concurrent cache hits on different
+ * cache shards do not wait for each other, and the device sees one command
+ * sequence at a time. Mounting, unmounting, changing write permission and
+ * configuring the cache or read-ahead must not race with I/O. */
+
+/* Return 1 on success and -1 on failure. Mounts the whole device as one
+ * volume. */
 int mdadm_mount(void);
 
+/* The shape of a volume: |num_disks| disks of |blocks_per_disk| blocks of
+ * |block_size| bytes each. With |stripe_blocks| 0 the disks are laid out one
+ * after the other in the linear address space; otherwise the address space
+ * is striped across them (RAID-0) in units of |stripe_blocks| blocks, so a
+ * long sequential request keeps several disks busy at once. */
+typedef struct {
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint32_t block_size;
+  uint32_t stripe_blocks;
+} mdadm_geometry_t;
+
+/* Return 1 on success and -1 on failure. Mounts a volume of the given shape,
+ * on the first disks and blocks of the device. The JBOD device has a fixed
+ * shape (JBOD_NUM_DISKS disks of JBOD_NUM_BLOCKS_PER_DISK blocks) and a fixed
+ * 32-bit command encoding, so a volume can be at most that big, and the block
+ * size must be JBOD_BLOCK_SIZE. A stripe unit must divide |blocks_per_disk|.
+ * None of the sizes has to be a power of two, but address translation is
+ * faster when they are. */
+int mdadm_mount_geometry(const mdadm_geometry_t *geometry);
+
+/* Copies the shape of the mounted volume, or the last mounted one, or the
+ * whole device if none has been, to |geometry|. */
+void mdadm_get_geometry(mdadm_geometry_t *geometry);
+
 /* Return 1 on success and -1 on failure */
 int mdadm_unmount(void);
 
@@ -23,4 +56,162 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* Return 1 on success and -1 on failure. Switches the cache, which must have
+ * been created, between write-back (|enable|) and write-through mode. In
+ * write-back mode mdadm_write only updates the cache, and dirty blocks reach
+ * the device when they are evicted, on mdadm_flush, when write permission is
+ * revoked and on mdadm_unmount. */
+int mdadm_set_write_back(bool enable);
+
+/* Return 1 on success and -1 on failure. Writes every dirty cached block to
+ * the device. Succeeds trivially when the cache is not in write-back mode. */
+int mdadm_flush(void);
+
+/* Return 1 on success and -1 on failure. Enables sequential read-ahead of up
+ * to |max_blocks| blocks (at most a disk's worth), or disables it when 0.
+ * Reads that continue where an earlier read ended prefetch the blocks after
+ * them into the cache while the head is already there; the window starts
+ * small and grows or shrinks with the share of prefetched blocks that are
+ * read. It only has an effect while the cache is enabled. */
+int mdadm_set_read_ahead(uint32_t max_blocks);
+
+/* Return 1 on success and -1 on failure. Starts (|enable|) or stops the
+ * per-disk I/O queues. While they run, each disk has a worker thread that
+ * services its queue in submission order, and mdadm_read and mdadm_write
+ * split their range into one sub-request per disk and wait for all of them,
+ * so the pieces of a request that spans disks are serviced concurrently.
+ * Stopping lets the workers drain their queues first. */
+int mdadm_set_io_queues(bool enable);
+
+/* Asynchronous versions of mdadm_read and mdadm_write, built on the per-disk
+ * I/O queues, which must be running. They check their arguments like the
+ * synchronous calls and return the same error codes, queue the request and
+ * return a ticket (>= 0) without waiting for it. They return -6 if the queue
+ * depth's worth of requests is already in flight. |buf| must stay valid until
+ * the request has been reaped by mdadm_poll or mdadm_wait, which every ticket
+ * must be exactly once. */
+int mdadm_submit_read(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_submit_write(uint32_t addr, uint32_t len, const uint8_t *buf);
+
+/* Return 1 if the request |ticket| has completed, reaping it and setting
+ * |result| to what the synchronous call would have returned, 0 if it is
+ * still in flight, and -1 if |ticket| names no request in flight. */
+int mdadm_poll(int ticket, int *result);
+
+/* Waits for the request |ticket| and reaps it. Returns what the synchronous
+ * call would have, or -4 if |ticket| names no request in flight. */
+int mdadm_wait(int ticket);
+
+/* Return 1 on success and -1 on failure. Sets how many asynchronous requests
+ * may be in flight at once (64 by default, at most 4096). Fails while any
+ * request is in flight. */
+int mdadm_set_queue_depth(int depth);
+
+/* One segment of a vectored I/O: |len| bytes at linear address |addr|, read
+ * into or written from |buf|. */
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  void *buf;
+} mdadm_iovec_t;
+
+/* Scatter/gather versions of mdadm_read and mdadm_write for |iovcnt|
+ * segments of any size. All segments are validated before any I/O is issued,
+ * then they are serviced in physical block order so that the whole call uses
+ * as few JBOD operations as possible. Segments of a write that overlap are
+ * applied in array order, so the later one wins. Return the total number of
+ * bytes transferred on success and the same error codes as mdadm_read and
+ * mdadm_write on failure. */
+int mdadm_readv(const mdadm_iovec_t *iov, int iovcnt);
+int mdadm_writev(const mdadm_iovec_t *iov, int iovcnt);
+
+/* One operation of a batch: a read into or a write from |buf| of |len| bytes
+ * at linear address |addr|, each limited like mdadm_read and mdadm_write. */
+typedef struct {
+  bool write;
+  uint32_t addr;
+  uint32_t len;
+  void *buf;
+} mdadm_batch_op_t;
+
+/* Runs |nops| operations with the same result as running them one after the
+ * other in array order, but reordered for the device: all operations are
+ * checked first, then split into per-block pieces that are serviced in one
+ * C-LOOK sweep from the current head position. Each block is read at most
+ * once and written at most once, with its final contents, so overlapping and
+ * adjacent operations are merged and writes that a later one covers are
+ * dropped. Returns the total number of bytes transferred on success and the
+ * error code of the first operation that fails the checks otherwise, or -4
+ * if the I/O fails. */
+int mdadm_run_batch(const mdadm_batch_op_t *ops, int nops);
+
+/* Size of a content signature (SHA-1). */
+#define MDADM_SIG_SIZE 20
+
+/* Brings the content signatures up to date with the volume and returns the
+ * number of blocks rehashed, or -1 on failure. Dirty cached blocks are
+ * flushed first. Only blocks written to the device since the last update (all
+ * of them after mounting) are read, from the cache where possible, and
+ * hashed, spread over up to |num_threads| threads; the signatures of their
+ * disks and of the volume are then recomputed from the block signatures. So
+ * an update costs in proportion to what changed. Safe to call concurrently
+ * with I/O and with itself; writes racing an update are picked up by the
+ * next one. */
+int mdadm_update_signatures(int num_threads);
+
+/* Return 1 on success and -1 on failure. Copy the signature of one block, of
+ * a disk or of the whole volume as of the last update into |sig|, which has
+ * room for MDADM_SIG_SIZE bytes. They fail until the first update after
+ * mounting. */
+int mdadm_block_signature(uint32_t disk, uint32_t block, uint8_t *sig);
+int mdadm_disk_signature(uint32_t disk, uint8_t *sig);
+int mdadm_volume_signature(uint8_t *sig);
+
+/* Warms the cache, which must be enabled, from a snapshot that cache_save
+ * wrote, and returns the number of blocks loaded or -1 on failure. The
+ * signatures are brought up to date first, and only blocks whose saved
+ * signature matches what the volume holds now are loaded, so a snapshot taken
+ * before the device changed cannot serve stale data. Must not race with
+ * writes. */
+int mdadm_load_cache(const char *path);
+
+/* Kinds of mdadm calls that latency is recorded for. */
+typedef enum {
+  MDADM_CALL_READ,
+  MDADM_CALL_WRITE,
+  MDADM_CALL_READV,
+  MDADM_CALL_WRITEV,
+  MDADM_CALL_BATCH,
+  MDADM_NUM_CALLS,
+} mdadm_call_t;
+
+#define MDADM_LATENCY_BUCKETS 32
+
+/* Counters since the program started or the counters were reset. */
+typedef struct {
+  uint64_t jbod_ops[JBOD_NUM_CMDS];  /* commands sent to the device, by jbod_cmd_t */
+  uint64_t jbod_errors;              /* commands the device failed */
+  uint64_t seeks_avoided;            /* seeks the known head position made unnecessary */
+  uint64_t bytes_read;               /* by successful calls */
+  uint64_t bytes_written;
+  uint64_t calls[MDADM_NUM_CALLS];
+  /* latency[c][b] counts calls of kind c that took at least 2^(b-1) and less
+   * than 2^b nanoseconds; the last bucket also holds anything slower. */
+  uint64_t latency[MDADM_NUM_CALLS][MDADM_LATENCY_BUCKETS];
+  cache_stats_t cache;
+} mdadm_stats_t;
+
+/* Copies a snapshot of the counters into |stats|. Counters are updated
+ * independently, so a snapshot taken during I/O may be off by the calls in
+ * flight. */
+void mdadm_get_stats(mdadm_stats_t *stats);
+
+/* Zeroes the counters, including the cache's. */
+void mdadm_reset_stats(void);
+
+/* Return 1 on success and -1 on failure. Writes the counters to |f| as one
+ * "name value" line each, in a fixed order, so that two dumps can be diffed.
+ * Latency lines are only written for non-empty buckets. */
+int mdadm_dump_stats(FILE *f);
+
 #endif
@@ -0,0 +1,243 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define POOL_STASH_SIZE 32
+
+/* Every slab starts with this header, in a line of its own. */
+struct pool_slab {
+    pool_slab_t *next;
+    size_t size;
+};
+
+_Static_assert(sizeof(pool_slab_t) <= POOL_ALIGN, "the slab header must fit in one line");
+
+/* A thread's free objects of one pool. It belongs to |pool| only while
+ * |generation| matches the pool's; destroying the pool changes that. */
+typedef struct {
+    pool_t *pool;
+    uint64_t generation;
+    int count;
+    void *objs[POOL_STASH_SIZE];
+} pool_stash_t;
+
+/* The live pools that have a stash slot, by slot. A thread's stash in slot i
+ * is only given back to its pool at exit if the slot still holds that pool
+ * and generation; pool_destroy frees the slot before the slabs go away. */
+typedef struct {
+    pool_t *pool;
+    uint64_t generation;
+} pool_slot_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_slot_t registry[POOL_MAX_POOLS];
+
+static _Thread_local pool_stash_t stashes[POOL_MAX_POOLS];
+static _Thread_local bool stashes_registered = false;
+static atomic_uint_fast64_t next_generation = 1;
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static inline void push_free(pool_t *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+}
+
+static inline void *pop_free(pool_t *pool) {
+    void *obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    return obj;
+}
+
+/* Gives the stashes of an exiting thread back to their pools, skipping those
+ * of pools that have been destroyed since, which may no longer exist. */
+static void stashes_exit(void *arg) {
+    pool_stash_t *s = arg;
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < POOL_MAX_POOLS; i++) {
+        pool_t *pool = s[i].pool;
+        if (pool == NULL || s[i].count == 0 || registry[i].pool != pool ||
+            registry[i].generation != s[i].generation) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (s[i].count > 0) {
+            push_free(pool, s[i].objs[--s[i].count]);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void exit_key_create(void) {
+    pthread_key_create(&exit_key, stashes_exit);
+}
+
+/* Gives |pool| the first free stash slot, or POOL_MAX_POOLS if every slot
+ * belongs to a live pool, and returns it. */
+static int claim_slot(pool_t *pool) {
+    pthread_mutex_lock(&registry_lock);
+    int id = pool->id;
+    if (id < 0) {
+        id = 0;
+        while (id < POOL_MAX_POOLS && registry[id].pool != NULL) {
+            id++;
+        }
+        if (id < POOL_MAX_POOLS) {
+            registry[id] = (pool_slot_t){ pool, pool->generation };
+        }
+        __atomic_store_n(&pool->id, id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return id;
+}
+
+/* Returns the calling thread's stash for |pool|, or NULL if it has none. */
+static pool_stash_t *pool_stash(pool_t *pool) {
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id < 0) {
+        id = claim_slot(pool);
+    }
+    if (id >= POOL_MAX_POOLS) {
+        return NULL;
+    }
+    pool_stash_t *s = &stashes[id];
+    if (s->pool != pool || s->generation != pool->generation) {
+        s->pool = pool;
+        s->generation = pool->generation;
+        s->count = 0;
+        if (!stashes_registered) {
+            pthread_once(&exit_once, exit_key_create);
+            pthread_setspecific(exit_key, stashes);
+            stashes_registered = true;
+        }
+    }
+    return s;
+}
+
+/* Returns 0 on success and -1 on failure. Maps a slab and threads its
+ * objects onto the free list, lowest address first. Called with the pool
+ * locked. */
+static int add_slab(pool_t *pool) {
+    size_t size = pool->slab_size;
+    if (size < POOL_ALIGN + pool->obj_size) {
+        size = POOL_ALIGN + pool->obj_size;
+    }
+    bool huge = size % POOL_HUGE_PAGE == 0;
+    void *map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (map == MAP_FAILED && huge) {
+        // No reserved huge pages, so ask for transparent ones, which need
+        // the slab aligned to a huge page
+        uint8_t *raw = mmap(NULL, size + POOL_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            uint8_t *aligned = (uint8_t *)(((uintptr_t)raw + POOL_HUGE_PAGE - 1) &
+                                           ~(uintptr_t)(POOL_HUGE_PAGE - 1));
+            if (aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            munmap(aligned + size, raw + POOL_HUGE_PAGE - aligned);
+            map = aligned;
+#ifdef MADV_HUGEPAGE
+            madvise(map, size, MADV_HUGEPAGE);
+#endif
+        }
+    } else if (map == MAP_FAILED) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    pool_slab_t *slab = map;
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->num_slabs++;
+    size_t n = (size - POOL_ALIGN) / pool->obj_size;
+    for (size_t i = n; i > 0; i--) {
+        push_free(pool, (uint8_t *)map + POOL_ALIGN + (i - 1) * pool->obj_size);
+    }
+    return 0;
+}
+
+void pool_init(pool_t *pool, size_t obj_size, size_t slab_size) {
+    pool_t init = POOL_INITIALIZER(obj_size, slab_size);
+    *pool = init;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->generation = atomic_fetch_add(&next_generation, 1);
+}
+
+void *pool_get(pool_t *pool) {
+    pool_stash_t *s = pool_stash(pool);
+    if (s != NULL && s->count > 0) {
+        return s->objs[--s->count];
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list == NULL && add_slab(pool) != 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    void *obj = pop_free(pool);
+    // Take half a stash while the lock is held anyway
+    while (s != NULL && s->count < POOL_STASH_SIZE / 2 && pool->free_list != NULL) {
+        s->objs[s->count++] = pop_free(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+}
+
+void pool_put(pool_t *pool, void *obj) {
+    pool_stash_t *s = pool_stash(pool);
+    if (s != NULL && s->count < POOL_STASH_SIZE) {
+        s->objs[s->count++] = obj;
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    push_free(pool, obj);
+    // Leave half a stash, so that alternating puts and gets stay local
+    while (s != NULL && s->count > POOL_STASH_SIZE / 2) {
+        push_free(pool, s->objs[--s->count]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool) {
+    // Exiting threads stop handing objects back before the slabs go away,
+    // and the slot is free for the next pool
+    pthread_mutex_lock(&registry_lock);
+    if (pool->id >= 0 && pool->id < POOL_MAX_POOLS && registry[pool->id].pool == pool) {
+        registry[pool->id].pool = NULL;
+    }
+    __atomic_store_n(&pool->id, -1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs != NULL) {
+        pool_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        munmap(slab, slab->size);
+    }
+    pool->free_list = NULL;
+    pool->num_slabs = 0;
+    pool->generation = atomic_fetch_add(&next_generation, 1);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t pool_num_slabs(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    size_t n = pool->num_slabs;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
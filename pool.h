@@ -0,0 +1,64 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-size object pools. Objects are carved out of large slabs mapped
+ * straight from the kernel, never from malloc, and are aligned to
+ * POOL_ALIGN. Slabs that are a whole number of huge pages are backed by huge
+ * pages where the system allows it, which keeps a large pool within a few TLB
+ * entries. Each thread keeps a small stash of free objects per pool, so
+ * getting and putting objects usually takes no lock; the shared free list is
+ * only visited to refill or drain a stash in batches. Freed objects go back
+ * to the pool, not to the kernel, so once a workload has warmed a pool up it
+ * allocates nothing more. */
+#define POOL_ALIGN 64
+#define POOL_HUGE_PAGE (2u << 20)
+
+/* Only this many live pools at a time get thread stashes; the slots of
+ * destroyed pools are reused, and a pool that finds none free goes straight
+ * to its shared list. */
+#define POOL_MAX_POOLS 16
+
+typedef struct pool_slab pool_slab_t;
+
+typedef struct {
+  size_t obj_size;      /* bytes per object, a multiple of POOL_ALIGN */
+  size_t slab_size;     /* bytes per slab, header included */
+  pthread_mutex_t lock; /* guards everything below */
+  void *free_list;      /* linked through the objects' first word */
+  pool_slab_t *slabs;
+  size_t num_slabs;
+  uint64_t generation;  /* tells thread stashes apart from a destroyed pool's */
+  int id;               /* slot of the thread stashes, -1 until first used, or
+                           POOL_MAX_POOLS if there was none free */
+} pool_t;
+
+/* Statically initializes a pool of |obj_size|-byte objects taken from slabs
+ * of about |slab_size| bytes; nothing is mapped until the first pool_get. */
+#define POOL_INITIALIZER(obj_size, slab_size)             \
+  { ((obj_size) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN, \
+    (slab_size), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, -1 }
+
+/* Same as POOL_INITIALIZER, for a pool that is not static. */
+void pool_init(pool_t *pool, size_t obj_size, size_t slab_size);
+
+/* Returns a free object, or NULL if no slab could be mapped. The contents of
+ * the object are undefined. */
+void *pool_get(pool_t *pool);
+
+/* Gives |obj|, which came from pool_get on |pool|, back to it. */
+void pool_put(pool_t *pool, void *obj);
+
+/* Unmaps every slab of |pool|, including objects still in use or in thread
+ * stashes, and leaves it as freshly initialized. Must not race with other
+ * calls on the pool. A pool that has been used must be destroyed before its
+ * memory goes away; threads that used it may exit at any time after. */
+void pool_destroy(pool_t *pool);
+
+/* Returns the number of slabs |pool| has mapped. */
+size_t pool_num_slabs(pool_t *pool);
+
+#endif
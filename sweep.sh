@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Replays every traces/*-input file at cache sizes 2 to 4096 under every
+# eviction policy, plus once without a cache, and prints one CSV line per
+# configuration. Each run's signatures are checked against the matching
+# traces/*-expected-output. Exits with status 1 if any run does not match.
+#
+# usage: ./sweep.sh [extra tester options] > sweep.csv
+
+TESTER=${TESTER:-./tester}
+POLICIES="mru lru clock 2q arc"
+SIZES="2 4 8 16 32 64 128 256 512 1024 2048 4096"
+
+stats=$(mktemp)
+out=$(mktemp)
+errs=$(mktemp)
+trap 'rm -f "$stats" "$out" "$errs"' EXIT
+
+# prints the value of counter $1 in the statistics dump
+stat() {
+  awk -v name="$1" '$1 == name { print $2 }' "$stats"
+}
+
+status=0
+echo "trace,policy,cache_size,seconds,ops_per_sec,hit_rate,jbod_cost,device_ops_per_kib,output"
+for input in traces/*-input; do
+  trace=$(basename "$input" -input)
+  expected=traces/$trace-expected-output
+  configs="none:0"
+  for p in $POLICIES; do
+    for s in $SIZES; do
+      configs="$configs $p:$s"
+    done
+  done
+  for config in $configs; do
+    policy=${config%:*}
+    size=${config#*:}
+    args=()
+    if [ "$size" -gt 0 ]; then
+      args=(-s "$size" -p "$policy")
+    fi
+    if ! "$TESTER" -w "$input" "${args[@]}" -d "$stats" "$@" >"$out" 2>"$errs"; then
+      echo "$trace,$policy,$size,,,,,,error"
+      status=1
+      continue
+    fi
+    if cmp -s "$out" "$expected"; then
+      result=ok
+    else
+      result=mismatch
+      status=1
+    fi
+    seconds=$(stat workload.seconds)
+    commands=$(stat workload.commands)
+    queries=$(stat cache.queries)
+    hits=$(stat cache.hits)
+    cost=$(sed -n 's/^Cost: *//p' "$errs")
+    awk -v t="$trace" -v p="$policy" -v s="$size" -v sec="$seconds" -v n="$commands" \
+        -v q="$queries" -v h="$hits" -v c="$cost" -v k="$(stat mdadm.device_ops_per_kib)" \
+        -v r="$result" 'BEGIN {
+      ops = sec > 0 ? n / sec : 0
+      rate = q > 0 ? sprintf("%.4f", h / q) : ""
+      printf "%s,%s,%d,%.6f,%.0f,%s,%s,%s,%s\n", t, p, s, sec, ops, rate, c, k, r
+    }'
+  done
+done
+exit $status
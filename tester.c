@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -10,18 +11,32 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "jbod.h"
 #include "mdadm.h"
 #include "util.h"
 #include "tester.h"
+#include "trace.h"
+#include "block.h"
+#include "pool.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
+#define TESTER_ARGUMENTS "hw:s:p:abr:qe:d:c:l:"
 #define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size]\n"                   \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-p policy] [-a] [-b] [-r blocks] [-q] [-e batch] [-d stats-file] [-c trace-file] [-l log-file]\n" \
   "\n"                                                      \
   "where:\n"                                                \
   "    -h - help mode (display this message)\n"             \
+  "    -p - cache eviction policy: mru (default), lru, clock, 2q or arc\n" \
+  "    -a - admit missed blocks only if they look hotter than the victim\n" \
+  "    -b - write-back cache (default is write-through)\n"  \
+  "    -r - read up to this many blocks ahead of sequential reads (default 0)\n" \
+  "    -q - service each disk from its own I/O queue and worker thread\n" \
+  "    -e - run reads and writes in elevator-ordered batches of this many\n" \
+  "    -d - dump statistics to this file after the workload\n" \
+  "    -c - convert the text workload to a binary trace in this file and exit\n" \
+  "    -l - log every JBOD operation to this file from a background thread\n" \
   "\n"                                                      \
 
 /* Test functions. */
@@ -50,6 +65,50 @@ int test_cache_update();
 int test_cache_mru_insert();
 int test_cache_mru_lookup();
 int test_cache_resize();
+int test_cache_lru_lookup();
+int test_cache_policies();
+int test_cache_resize_keeps_hot();
+int test_cache_snapshot();
+int test_cache_admission();
+
+/* Test functions for vectored I/O. */
+int test_readv_writev();
+
+/* Test functions for write-back caching. */
+int test_cache_write_back();
+int test_cache_partial_writes();
+int test_write_back_follows_head();
+
+/* Test functions for read-ahead. */
+int test_read_ahead();
+
+/* Test functions for batched I/O. */
+int test_run_batch();
+
+/* Test functions for statistics. */
+int test_stats();
+
+/* Test functions for volume geometry. */
+int test_mount_geometry();
+int test_mount_striped();
+
+/* Test functions for binary traces. */
+int test_binary_trace();
+
+/* Test functions for utilities. */
+int test_block_kernels();
+int test_async_log();
+int test_rand_seed();
+int test_pool();
+
+/* Test functions for content signatures. */
+int test_signatures();
+int test_load_cache();
+
+/* Test functions for thread safety. */
+int test_concurrent_io();
+int test_io_queues_across_disks();
+int test_async_io();
 
 /* Utility functions. */
 char *stringify(const uint8_t *buf, int length) {
@@ -62,12 +121,22 @@ char *stringify(const uint8_t *buf, int length) {
   return p;
 }
 
-int run_workload(char *workload, int cache_size);
+int run_workload(char *workload, int cache_size, cache_policy_t policy, bool admission,
+                 bool write_back, int read_ahead, bool io_queues, int batch_size,
+                 const char *stats_file);
 
 int main(int argc, char *argv[])
 {
   int ch, cache_size = 0;
   char *workload = NULL;
+  cache_policy_t policy = CACHE_POLICY_MRU;
+  bool admission = false;
+  bool write_back = false;
+  int read_ahead = 0;
+  bool io_queues = false;
+  int batch_size = 0;
+  char *stats_file = NULL;
+  char *trace_file = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -80,14 +149,55 @@ int main(int argc, char *argv[])
       case 's':
          cache_size = atoi(optarg);
          break;
+      case 'p':
+        if (cache_policy_parse(optarg, &policy) != 1) {
+          fprintf(stderr, "Unknown cache policy (%s), aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'a':
+        admission = true;
+        break;
+      case 'b':
+        write_back = true;
+        break;
+      case 'r':
+        read_ahead = atoi(optarg);
+        break;
+      case 'q':
+        io_queues = true;
+        break;
+      case 'e':
+        batch_size = atoi(optarg);
+        break;
+      case 'd':
+        stats_file = optarg;
+        break;
+      case 'c':
+        trace_file = optarg;
+        break;
+      case 'l':
+        set_debug_logfile(optarg);
+        enable_async_debug_log();
+        enable_debug_log();
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
     }
   }
 
+  if (trace_file) {
+    if (!workload) {
+      fprintf(stderr, "Converting needs a workload file (-w), aborting.\n");
+      return -1;
+    }
+    return trace_convert(workload, trace_file) == -1 ? -1 : 0;
+  }
+
   if (workload) {
-    run_workload(workload, cache_size);
+    run_workload(workload, cache_size, policy, admission, write_back, read_ahead, io_queues,
+                 batch_size, stats_file);
     return 0;
   }
     
@@ -116,8 +226,42 @@ int main(int argc, char *argv[])
   score += test_cache_mru_insert();
   score += test_cache_mru_lookup();
   score += test_cache_resize();
+  score += test_cache_lru_lookup();
+  score += test_cache_policies();
+  score += test_cache_resize_keeps_hot();
+  score += test_cache_snapshot();
+  score += test_cache_admission();
+
+  score += test_readv_writev();
+
+  score += test_cache_write_back();
+  score += test_cache_partial_writes();
+  score += test_write_back_follows_head();
+
+  score += test_read_ahead();
+
+  score += test_run_batch();
+
+  score += test_stats();
+
+  score += test_mount_geometry();
+  score += test_mount_striped();
+
+  score += test_binary_trace();
+
+  score += test_block_kernels();
+  score += test_async_log();
+  score += test_rand_seed();
+  score += test_pool();
+
+  score += test_signatures();
+  score += test_load_cache();
+
+  score += test_concurrent_io();
+  score += test_io_queues_across_disks();
+  score += test_async_io();
 
-  printf("Total score: %d/%d\n", score, 27);
+  printf("Total score: %d/%d\n", score, 51);
 
   return 0;
 }
@@ -1045,67 +1189,1908 @@ out:
   return 1;
 }
 
-int equals(const char *s1, const char *s2) {
-  return strncmp(s1, s2, strlen(s2)) == 0;
-}
+/* Testing lru in the case of a workload with inserts and lookups. We insert 3
+ * entries to an LRU cache of size 3 and look up the oldest one, so that the
+ * fourth insert has to evict the entry that has gone longest without use. */
+int test_cache_lru_lookup() {
+  printf("running %s: ", __func__);
 
-int run_workload(char *workload, int cache_size) {
-  char line[256], cmd[32];
-  uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
-  int rc;
+  bool success = false;
+  uint8_t in[JBOD_BLOCK_SIZE] = { [0 ... JBOD_BLOCK_SIZE-1] = 0xaa };
+  uint8_t out[JBOD_BLOCK_SIZE];
 
-  memset(buf, 0, MAX_IO_SIZE);
+  cache_create_with_policy(3, CACHE_POLICY_LRU);
 
-  FILE *f = fopen(workload, "r");
-  if (!f)
-    err(1, "Cannot open workload file %s", workload);
+  cache_insert(8, 9, in);
+  cache_insert(3, 5, in);
+  cache_insert(1, 7, in);
 
-  if (cache_size) {
-    rc = cache_create(cache_size);
-    if (rc != 1)
-      errx(1, "Failed to create cache.");
+  cache_lookup(8, 9, out); /* 3, 5 is now the least recently used entry */
+
+  cache_insert(15, 255, in);
+
+  if (cache_lookup(3, 5, out) != -1) {
+    printf("failed: the entry 3, 5 should have been evicted but it was not.\n");
+    goto out;
   }
 
-  int line_num = 0;
-  while (fgets(line, 256, f)) {
-    ++line_num;
-    line[strlen(line)-1] = '\0';
-    if (equals(line, "MOUNT")) {
-      rc = mdadm_mount();
-    } else if (equals(line, "UNMOUNT")) {
-      rc = mdadm_unmount();
-    } else if (equals(line, "WRITE_PERMIT")) {
-      rc = mdadm_write_permission();
-    } else if (equals(line, "WRITE_PERMIT_REVOKE")) {
-      rc = mdadm_revoke_write_permission();
-    } else if (equals(line, "SIGNALL")) {
-      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
-        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j)
-          jbod_sign_block(i, j);
-    } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
-        errx(1, "Failed to parse command: [%s\n], aborting.", line);
-      if (equals(cmd, "READ")) {
-        rc = mdadm_read(addr, len, buf);
-      } else if (equals(cmd, "WRITE")) {
-        memset(buf, ch, len);
-        rc = mdadm_write(addr, len, buf);
+  if (cache_lookup(8, 9, out) != 1 || cache_lookup(1, 7, out) != 1) {
+    printf("failed: only the least recently used entry should have been evicted.\n");
+    goto out;
+  }
+
+  success = true;
+
+out:
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/* Testing that every eviction policy keeps the cache at its capacity and
+ * returns the data that was inserted for the entries it keeps. */
+int test_cache_policies() {
+  printf("running %s: ", __func__);
+
+  const int size = 8;
+  uint8_t in[JBOD_BLOCK_SIZE];
+  uint8_t out[JBOD_BLOCK_SIZE];
+
+  for (int p = 0; p < CACHE_NUM_POLICIES; ++p) {
+    if (cache_create_with_policy(size, p) != 1) {
+      printf("failed: creating a cache with policy %s should succeed but it failed.\n",
+             cache_policy_name(p));
+      return 0;
+    }
+
+    /* A looping pattern with re-references, so that policies with ghost
+     * queues see ghost hits as well. */
+    for (int n = 0; n < 200; ++n) {
+      int block = (n * 7) % 23;
+      if (cache_lookup(2, block, out) == 1) {
+        if (out[0] != block) {
+          printf("failed: policy %s returned the wrong data for block %d.\n",
+                 cache_policy_name(p), block);
+          cache_destroy();
+          return 0;
+        }
       } else {
-        errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
+        memset(in, block, JBOD_BLOCK_SIZE);
+        if (cache_insert(2, block, in) != 1) {
+          printf("failed: policy %s failed to insert block %d.\n",
+                 cache_policy_name(p), block);
+          cache_destroy();
+          return 0;
+        }
       }
     }
 
-    if (rc == -1)
-      errx(1, "tester failed when processing command [%s] on line %d", line, line_num);
+    int resident = 0;
+    for (int block = 0; block < 23; ++block)
+      resident += cache_lookup(2, block, out) == 1;
+    cache_destroy();
+
+    if (resident != size) {
+      printf("failed: policy %s kept %d entries in a cache of %d.\n",
+             cache_policy_name(p), resident, size);
+      return 0;
+    }
   }
-  fclose(f);
 
-  if (cache_size)
+  if (cache_create_with_policy(size, CACHE_NUM_POLICIES) != -1) {
+    printf("failed: creating a cache with an invalid policy should fail but succeeded.\n");
     cache_destroy();
+    return 0;
+  }
 
-  //jbod_print_cost();
-  cache_print_hit_rate();
+  printf("passed\n");
+  return 1;
+}
+
+/* Testing that shrinking an LRU cache keeps the recently used entries, and
+ * that growing it again keeps everything that is resident. */
+int test_cache_resize_keeps_hot() {
+  printf("running %s: ", __func__);
+
+  bool success = false;
+  uint8_t in[JBOD_BLOCK_SIZE];
+  uint8_t out[JBOD_BLOCK_SIZE];
+
+  cache_create_with_policy(8, CACHE_POLICY_LRU);
+
+  for (int block = 0; block < 8; ++block) {
+    memset(in, block, JBOD_BLOCK_SIZE);
+    cache_insert(4, block, in);
+  }
+
+  /* Make the odd blocks, which live in all parts of the cache, the hot ones. */
+  for (int block = 1; block < 8; block += 2)
+    cache_lookup(4, block, out);
+
+  if (cache_resize(4) != 1) {
+    printf("failed: shrinking the cache should succeed but it failed.\n");
+    goto out;
+  }
+
+  for (int block = 0; block < 8; ++block) {
+    int rc = cache_lookup(4, block, out);
+    if ((block % 2 == 1) != (rc == 1)) {
+      printf("failed: shrinking should keep exactly the hot entries, block %d was %s.\n",
+             block, rc == 1 ? "kept" : "evicted");
+      goto out;
+    }
+    if (rc == 1 && out[0] != block) {
+      printf("failed: block %d has the wrong data after shrinking.\n", block);
+      goto out;
+    }
+  }
+
+  if (cache_resize(16) != 1) {
+    printf("failed: growing the cache should succeed but it failed.\n");
+    goto out;
+  }
+
+  for (int block = 100; block < 112; ++block) {
+    memset(in, block, JBOD_BLOCK_SIZE);
+    cache_insert(4, block, in);
+  }
+
+  for (int block = 1; block < 8; block += 2) {
+    if (cache_lookup(4, block, out) != 1 || out[0] != block) {
+      printf("failed: block %d should survive growing the cache but it did not.\n", block);
+      goto out;
+    }
+  }
+
+  success = true;
+
+out:
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+static bool reject_block_3(int disk_num, int block_num, const uint8_t *sig) {
+  return block_num != 3;
+}
+
+/* Testing that a cache snapshot brings back the hottest blocks in their
+ * recency order, and that blocks damaged in the file or rejected by the
+ * validator are left out. */
+int test_cache_snapshot() {
+  printf("running %s: ", __func__);
+
+  bool success = false;
+  char path[] = "/tmp/tester-snapshot-XXXXXX";
+  uint8_t in[JBOD_BLOCK_SIZE];
+  uint8_t out[JBOD_BLOCK_SIZE];
+
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    printf("failed: cannot create a temporary file.\n");
+    return 0;
+  }
+  close(fd);
+
+  cache_create_with_policy(4, CACHE_POLICY_LRU);
+  for (int block = 0; block < 4; ++block) {
+    memset(in, block + 1, JBOD_BLOCK_SIZE);
+    cache_insert(2, block, in);
+  }
+  /* From coldest to hottest: blocks 1, 2, 3, 0. */
+  cache_lookup(2, 0, out);
+  if (cache_save(path) != 4) {
+    printf("failed: saving a full cache of 4 blocks should save 4 blocks.\n");
+    goto out;
+  }
+  cache_destroy();
+
+  /* Only 3 fit, so the coldest is left out, and the next coldest is the
+   * first to go. */
+  cache_create_with_policy(3, CACHE_POLICY_LRU);
+  if (cache_load(path, NULL) != 3 || cache_contains(2, 1)) {
+    printf("failed: loading into 3 entries should load the 3 hottest blocks.\n");
+    goto out;
+  }
+  memset(in, 0xff, JBOD_BLOCK_SIZE);
+  cache_insert(2, 100, in);
+  if (cache_contains(2, 2) || !cache_contains(2, 3) || !cache_contains(2, 0)) {
+    printf("failed: loaded blocks should be evicted in their saved recency order.\n");
+    goto out;
+  }
+  for (int block = 0; block < 4; block += 3) {
+    if (cache_lookup(2, block, out) != 1 || out[0] != block + 1) {
+      printf("failed: block %d should have been loaded with its data.\n", block);
+      goto out;
+    }
+  }
+  cache_destroy();
+
+  cache_create_with_policy(8, CACHE_POLICY_LRU);
+  if (cache_load(path, reject_block_3) != 3 || cache_contains(2, 3)) {
+    printf("failed: a block the validator rejects should not be loaded.\n");
+    goto out;
+  }
+  cache_destroy();
+
+  /* The last byte of the file is in the block of the hottest record. */
+  FILE *f = fopen(path, "r+");
+  if (!f || fseek(f, -1, SEEK_END) != 0 || fputc(0xee, f) == EOF || fclose(f) != 0) {
+    printf("failed: cannot damage the snapshot.\n");
+    goto out;
+  }
+  cache_create_with_policy(8, CACHE_POLICY_LRU);
+  if (cache_load(path, NULL) != 3 || cache_contains(2, 0)) {
+    printf("failed: a block damaged in the snapshot should not be loaded.\n");
+    goto out;
+  }
+  if (truncate(path, 10) != 0 || cache_load(path, NULL) != -1) {
+    printf("failed: a file that is not a snapshot should not load.\n");
+    goto out;
+  }
+
+  success = true;
+
+out:
+  cache_destroy();
+  unlink(path);
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/* Looks a block up the way mdadm does, and inserts it on a miss. */
+static void cache_access(int disk_num, int block_num) {
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  if (cache_lookup(disk_num, block_num, buf) != 1) {
+    memset(buf, block_num, JBOD_BLOCK_SIZE);
+    cache_insert(disk_num, block_num, buf);
+  }
+}
+
+/* Testing that with the admission filter on, a scan through many blocks
+ * that are never reused leaves a hot set in an LRU cache alone, when
+ * without it the scan flushes the hot set out. */
+int test_cache_admission() {
+  printf("running %s: ", __func__);
+
+  bool success = false;
+  cache_stats_t stats;
+
+  for (int admission = 0; admission < 2; ++admission) {
+    cache_create_with_policy(20, CACHE_POLICY_LRU);
+    if (admission && (cache_set_admission(true) != 1 || !cache_admission_enabled())) {
+      printf("failed: turning the admission filter on should succeed but it failed.\n");
+      goto out;
+    }
+    for (int round = 0; round < 5; ++round)
+      for (int block = 0; block < 10; ++block)
+        cache_access(1, block);
+    for (int block = 100; block < 300; ++block)
+      cache_access(1, block);
+
+    int hot = 0;
+    for (int block = 0; block < 10; ++block)
+      hot += cache_contains(1, block);
+    cache_get_stats(&stats);
+    if (admission && (hot != 10 || stats.rejections == 0)) {
+      printf("failed: the scan should have been kept out, but %d hot blocks are left.\n", hot);
+      goto out;
+    }
+    if (!admission && (hot != 0 || stats.rejections != 0)) {
+      printf("failed: without the filter the scan should flush the hot blocks.\n");
+      goto out;
+    }
+
+    /* Whatever is in the window stays cached when the filter goes away. */
+    int cached = 0;
+    for (int block = 0; block < 300; ++block)
+      cached += cache_contains(1, block);
+    if (cache_set_admission(false) != 1 || cache_admission_enabled()) {
+      printf("failed: turning the admission filter off should succeed but it failed.\n");
+      goto out;
+    }
+    for (int block = 0; block < 300; ++block)
+      cached -= cache_contains(1, block);
+    if (cached != 0) {
+      printf("failed: turning the filter off should not drop cached blocks.\n");
+      goto out;
+    }
+    cache_destroy();
+  }
+  success = true;
+
+out:
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test writes three out-of-order segments with mdadm_writev: 64 KB
+ * covering all of disk 3, 300 bytes straddling the end of disk 2 and a
+ * 16-byte segment inside the first one, which must win because it comes
+ * later. It then reads everything back with one mdadm_readv.
+ */
+#define BIG_IO_SIZE JBOD_DISK_SIZE
+
+int test_readv_writev() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = false;
+  uint8_t *big = malloc(BIG_IO_SIZE);
+  uint8_t *big_out = malloc(BIG_IO_SIZE);
+  uint8_t small[300], small_out[300];
+  uint8_t patch[16], patch_out[16];
+
+  for (int i = 0; i < BIG_IO_SIZE; ++i)
+    big[i] = i * 7;
+  memset(small, 0x5a, sizeof(small));
+  memset(patch, 0xc3, sizeof(patch));
+
+  uint32_t disk3 = 3 * JBOD_DISK_SIZE;
+  mdadm_iovec_t wiov[] = {
+    { disk3, BIG_IO_SIZE, big },
+    { disk3 - 150, sizeof(small), small },
+    { disk3 + 1000, sizeof(patch), patch },
+  };
+
+  int rc = mdadm_writev(wiov, 3);
+  if (rc != BIG_IO_SIZE + 316) {
+    printf("failed: writev of 3 segments should return %d but returned %d.\n",
+           BIG_IO_SIZE + 316, rc);
+    goto out;
+  }
+
+  mdadm_iovec_t bad[] = { { JBOD_NUM_DISKS * JBOD_DISK_SIZE - 8, 16, patch } };
+  if (mdadm_writev(bad, 1) != -1 || mdadm_readv(bad, 1) != -1) {
+    printf("failed: vectored I/O beyond the end of the address space should fail but it did not.\n");
+    goto out;
+  }
+
+  /* The overlapped bytes are expected to hold what the later segments wrote. */
+  memcpy(big, small + 150, 150);
+  memcpy(big + 1000, patch, sizeof(patch));
+
+  mdadm_iovec_t riov[] = {
+    { disk3 + 1000, sizeof(patch_out), patch_out },
+    { disk3, BIG_IO_SIZE, big_out },
+    { disk3 - 150, sizeof(small_out), small_out },
+  };
+
+  rc = mdadm_readv(riov, 3);
+  if (rc != BIG_IO_SIZE + 316) {
+    printf("failed: readv of 3 segments should return %d but returned %d.\n",
+           BIG_IO_SIZE + 316, rc);
+    goto out;
+  }
+
+  if (memcmp(big, big_out, BIG_IO_SIZE) != 0 ||
+      memcmp(small, small_out, sizeof(small)) != 0 ||
+      memcmp(patch, patch_out, sizeof(patch)) != 0) {
+    printf("failed: data read with readv does not match what writev wrote.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  free(big);
+  free(big_out);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test writes the first 16 bytes of block 1 of disk 0 twice through a
+ * write-back cache. Neither write may reach the device until mdadm_flush,
+ * after which the device must hold the second one.
+ */
+int test_cache_write_back() {
+  printf("running %s: ", __func__);
+
+  cache_create(4);
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = false;
+  uint8_t first[SIZE] = { [0 ... SIZE-1] = 0x11 };
+  uint8_t second[SIZE] = { [0 ... SIZE-1] = 0x22 };
+  uint8_t before[SIZE], out[SIZE];
+
+  if (mdadm_set_write_back(true) != 1) {
+    printf("failed: enabling write-back on a cache should succeed but it failed.\n");
+    goto out;
+  }
+
+  jbod_fill_block_test_write_within_block(before);
+
+  if (mdadm_write(256, SIZE, first) != SIZE || mdadm_write(256, SIZE, second) != SIZE) {
+    printf("failed: write failed\n");
+    goto out;
+  }
+
+  jbod_fill_block_test_write_within_block(out);
+  if (memcmp(out, before, SIZE) != 0) {
+    printf("failed: a write-back write should not reach the device before a flush.\n");
+    goto out;
+  }
+
+  if (mdadm_read(256, SIZE, out) != SIZE || memcmp(out, second, SIZE) != 0) {
+    printf("failed: a read should see the dirty data in the cache.\n");
+    goto out;
+  }
+
+  if (mdadm_flush() != 1) {
+    printf("failed: flush failed\n");
+    goto out;
+  }
+
+  jbod_fill_block_test_write_within_block(out);
+  if (memcmp(out, second, SIZE) != 0) {
+    char *out_s = stringify(out, SIZE);
+    char *expected_s = stringify(second, SIZE);
+
+    printf("failed:\n  got:      %s\n  expected: %s\n", out_s, expected_s);
+
+    free(out_s);
+    free(expected_s);
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test builds block 1 of disk 0 out of two partial writes through a
+ * write-back cache, which must not read it from the device, and writes part
+ * of block 2, whose other bytes must come from the device once it is read.
+ */
+int test_cache_partial_writes() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = false;
+  uint8_t old[JBOD_BLOCK_SIZE] = { [0 ... JBOD_BLOCK_SIZE-1] = 0x66 };
+  // The partial writes come from heap buffers of exactly their length, so
+  // reading past what was written is caught under a sanitizer
+  uint8_t *head = malloc(100), *mid = malloc(20);
+  uint8_t tail[JBOD_BLOCK_SIZE - 100] = { [0 ... JBOD_BLOCK_SIZE-101] = 0x44 };
+  uint8_t expected[2 * JBOD_BLOCK_SIZE], out[2 * JBOD_BLOCK_SIZE];
+  cache_stats_t stats;
+  mdadm_stats_t st;
+
+  memset(head, 0x33, 100);
+  memset(mid, 0x55, 20);
+
+  memset(expected, 0x33, 100);
+  memset(expected + 100, 0x44, JBOD_BLOCK_SIZE - 100);
+  memset(expected + JBOD_BLOCK_SIZE, 0x66, JBOD_BLOCK_SIZE);
+  memset(expected + JBOD_BLOCK_SIZE + 10, 0x55, 20);
+
+  // Block 2 gets its old contents before there is a cache to hold them
+  if (mdadm_write(2 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, old) != JBOD_BLOCK_SIZE) {
+    printf("failed: write failed\n");
+    goto out;
+  }
+  cache_create(4);
+  if (mdadm_set_write_back(true) != 1) {
+    printf("failed: enabling write-back on a cache should succeed but it failed.\n");
+    goto out;
+  }
+  mdadm_reset_stats();
+
+  if (mdadm_write(JBOD_BLOCK_SIZE, 100, head) != 100 ||
+      mdadm_write(JBOD_BLOCK_SIZE + 100, sizeof(tail), tail) != sizeof(tail) ||
+      mdadm_write(2 * JBOD_BLOCK_SIZE + 10, 20, mid) != 20) {
+    printf("failed: write failed\n");
+    goto out;
+  }
+
+  if (mdadm_read(JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE ||
+      memcmp(out, expected, JBOD_BLOCK_SIZE) != 0) {
+    printf("failed: a block built from partial writes should read back whole.\n");
+    goto out;
+  }
+  cache_get_stats(&stats);
+  mdadm_get_stats(&st);
+  if (stats.fills != 0 || st.jbod_ops[JBOD_READ_BLOCK] != 0) {
+    printf("failed: a block that was written all over should not be read from the device.\n");
+    goto out;
+  }
+
+  if (mdadm_read(2 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE ||
+      memcmp(out, expected + JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE) != 0) {
+    printf("failed: reading a partly written block should merge in the device's bytes.\n");
+    goto out;
+  }
+  cache_get_stats(&stats);
+  if (stats.fills != 1) {
+    printf("failed: reading a partly written block should read it once, not %d times.\n",
+           stats.fills);
+    goto out;
+  }
+
+  // What reaches the device is checked without the cache in the way
+  if (mdadm_set_write_back(false) != 1) {
+    printf("failed: flush failed\n");
+    goto out;
+  }
+  cache_destroy();
+  if (mdadm_read(JBOD_BLOCK_SIZE, sizeof(out), out) != sizeof(out) ||
+      memcmp(out, expected, sizeof(out)) != 0) {
+    printf("failed: the device should hold the partial writes after a flush.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  cache_destroy();
+  free(head);
+  free(mid);
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+#define BLOCK_ADDR(disk, block) ((disk) * JBOD_DISK_SIZE + (block) * JBOD_BLOCK_SIZE)
+
+/*
+ * This test dirties blocks 7, 5 and 6 of disk 3 through a write-back LRU
+ * cache while the head is on disk 3, then reads disk 4, which must first write
+ * them back in block order without leaving the disk. It then fills the cache
+ * with dirty blocks of disk 5 and reads disk 6, which must not be cached
+ * rather than push a dirty block out.
+ */
+int test_write_back_follows_head() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+  cache_create_with_policy(4, CACHE_POLICY_LRU);
+
+  bool success = false;
+  uint8_t buf[JBOD_BLOCK_SIZE] = { [0 ... JBOD_BLOCK_SIZE-1] = 0x77 };
+  uint8_t two[2 * JBOD_BLOCK_SIZE] = { [0 ... 2*JBOD_BLOCK_SIZE-1] = 0x78 };
+  uint8_t out[JBOD_BLOCK_SIZE];
+  cache_stats_t stats;
+  mdadm_stats_t st;
+
+  if (mdadm_set_write_back(true) != 1) {
+    printf("failed: enabling write-back on a cache should succeed but it failed.\n");
+    goto out;
+  }
+  if (mdadm_read(BLOCK_ADDR(3, 0), JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE ||
+      mdadm_write(BLOCK_ADDR(3, 7), JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE ||
+      mdadm_write(BLOCK_ADDR(3, 5), sizeof(two), two) != sizeof(two)) {
+    printf("failed: read or write failed\n");
+    goto out;
+  }
+
+  mdadm_reset_stats();
+  cache_reset_stats();
+  if (mdadm_read(BLOCK_ADDR(4, 0), JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+  cache_get_stats(&stats);
+  mdadm_get_stats(&st);
+  if (stats.writebacks != 3 || st.jbod_ops[JBOD_WRITE_BLOCK] != 3) {
+    printf("failed: leaving disk 3 should write its 3 dirty blocks, not %d.\n", stats.writebacks);
+    goto out;
+  }
+  if (st.jbod_ops[JBOD_SEEK_TO_DISK] != 1 || st.jbod_ops[JBOD_SEEK_TO_BLOCK] != 1) {
+    printf("failed: the dirty blocks should go out in one pass before the seek away.\n");
+    goto out;
+  }
+
+  for (int b = 1; b <= 4; ++b) {
+    if (mdadm_write(BLOCK_ADDR(5, b), JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE) {
+      printf("failed: write failed\n");
+      goto out;
+    }
+  }
+  cache_reset_stats();
+  if (mdadm_read(BLOCK_ADDR(6, 0), JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+  cache_get_stats(&stats);
+  if (stats.writebacks != 0 || cache_contains(6, 0) || !cache_contains(5, 1)) {
+    printf("failed: a read should not push a dirty block out of the cache.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test reads blocks 0 and 1 of disk 0 one after the other. The second
+ * read continues the stream, so the blocks after it must be prefetched into
+ * the cache, and reading them must return what the device holds.
+ */
+int test_read_ahead() {
+  printf("running %s: ", __func__);
+
+  cache_create_with_policy(64, CACHE_POLICY_LRU);
+  mdadm_set_read_ahead(8);
+  mdadm_mount();
+  jbod_initialize_drives_contents();
+
+  bool success = false;
+  uint8_t out[6 * JBOD_BLOCK_SIZE], expected[6 * JBOD_BLOCK_SIZE];
+
+  if (mdadm_read(0, JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE ||
+      mdadm_read(JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, out + JBOD_BLOCK_SIZE) != JBOD_BLOCK_SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+
+  for (int b = 2; b < 6; ++b) {
+    if (!cache_contains(0, b)) {
+      printf("failed: block %d should have been read ahead but it is not cached.\n", b);
+      goto out;
+    }
+  }
+
+  if (mdadm_read(2 * JBOD_BLOCK_SIZE, 4 * JBOD_BLOCK_SIZE, out + 2 * JBOD_BLOCK_SIZE) !=
+      4 * JBOD_BLOCK_SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+
+  /* The same blocks straight from the device. */
+  cache_destroy();
+  if (mdadm_read(0, 4 * JBOD_BLOCK_SIZE, expected) != 4 * JBOD_BLOCK_SIZE ||
+      mdadm_read(4 * JBOD_BLOCK_SIZE, 2 * JBOD_BLOCK_SIZE, expected + 4 * JBOD_BLOCK_SIZE) !=
+      2 * JBOD_BLOCK_SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+
+  if (memcmp(out, expected, sizeof(out)) != 0) {
+    printf("failed: blocks read ahead do not match the device.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_unmount();
+  cache_destroy();
+  mdadm_set_read_ahead(0);
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test runs a batch that goes backwards over disk 0: a write to block 2
+ * that a later write covers, a write straddling blocks 0 and 1, and reads of
+ * both ranges. The reads must see the writes before them, and the device
+ * must end up with the last write to each byte.
+ */
+int test_run_batch() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+  jbod_initialize_drives_contents();
+
+  bool success = false;
+  uint8_t dropped[JBOD_BLOCK_SIZE], kept[JBOD_BLOCK_SIZE], straddle[SIZE];
+  uint8_t read_kept[JBOD_BLOCK_SIZE], read_straddle[SIZE], out[SIZE];
+  memset(dropped, 0x11, sizeof(dropped));
+  memset(kept, 0x22, sizeof(kept));
+  memset(straddle, 0x33, sizeof(straddle));
+
+  uint32_t straddle_addr = JBOD_BLOCK_SIZE - SIZE / 2;
+  mdadm_batch_op_t ops[] = {
+    { true, 2 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, dropped },
+    { true, straddle_addr, SIZE, straddle },
+    { true, 2 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, kept },
+    { false, 2 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, read_kept },
+    { false, straddle_addr, SIZE, read_straddle },
+  };
+  int total = 3 * JBOD_BLOCK_SIZE + 2 * SIZE;
+  if (mdadm_run_batch(ops, 5) != total) {
+    printf("failed: batch failed\n");
+    goto out;
+  }
+
+  if (memcmp(read_kept, kept, JBOD_BLOCK_SIZE) != 0 || memcmp(read_straddle, straddle, SIZE) != 0) {
+    printf("failed: a read in a batch should see the writes before it.\n");
+    goto out;
+  }
+
+  if (mdadm_read(2 * JBOD_BLOCK_SIZE, SIZE, out) != SIZE || memcmp(out, kept, SIZE) != 0 ||
+      mdadm_read(straddle_addr, SIZE, out) != SIZE || memcmp(out, straddle, SIZE) != 0) {
+    printf("failed: the device should hold the last write to each byte.\n");
+    goto out;
+  }
+
+  ops[1].addr = JBOD_NUM_DISKS * JBOD_DISK_SIZE;
+  if (mdadm_run_batch(ops, 5) != -1) {
+    printf("failed: a batch with an invalid operation should fail.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test reads block 3 of disk 0 twice without a cache and checks the
+ * counters: the first read seeks to the disk and the block, the second only
+ * to the block, since the head is already on the disk.
+ */
+int test_stats() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_reset_stats();
+
+  bool success = false;
+  uint8_t out[SIZE];
+  mdadm_stats_t st;
+  uint32_t addr = 3 * JBOD_BLOCK_SIZE;
+
+  if (mdadm_read(addr, SIZE, out) != SIZE || mdadm_read(addr, SIZE, out) != SIZE) {
+    printf("failed: read failed\n");
+    goto out;
+  }
+
+  mdadm_get_stats(&st);
+  uint64_t latency_total = 0;
+  for (int b = 0; b < MDADM_LATENCY_BUCKETS; ++b)
+    latency_total += st.latency[MDADM_CALL_READ][b];
+
+  if (st.jbod_ops[JBOD_SEEK_TO_DISK] != 1 || st.jbod_ops[JBOD_SEEK_TO_BLOCK] != 2 ||
+      st.jbod_ops[JBOD_READ_BLOCK] != 2 || st.seeks_avoided != 1) {
+    printf("failed: expected 1 disk seek, 2 block seeks, 2 reads and 1 avoided seek, "
+           "got %llu, %llu, %llu and %llu.\n",
+           (unsigned long long)st.jbod_ops[JBOD_SEEK_TO_DISK],
+           (unsigned long long)st.jbod_ops[JBOD_SEEK_TO_BLOCK],
+           (unsigned long long)st.jbod_ops[JBOD_READ_BLOCK],
+           (unsigned long long)st.seeks_avoided);
+    goto out;
+  }
+  if (st.calls[MDADM_CALL_READ] != 2 || latency_total != 2 || st.bytes_read != 2 * SIZE) {
+    printf("failed: two reads of %d bytes should have been recorded.\n", SIZE);
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+static int raw_read_block(int disk, int block, uint8_t *buf) {
+  if (jbod_operation(JBOD_SEEK_TO_DISK << 12 | disk, NULL) != 0 ||
+      jbod_operation(JBOD_SEEK_TO_BLOCK << 12 | block << 4, NULL) != 0)
+    return -1;
+  return jbod_operation(JBOD_READ_BLOCK << 12, buf);
+}
+
+/*
+ * This test mounts a volume of three disks of 100 blocks, writes across the
+ * boundary of its first two disks and checks on the device that the two
+ * halves landed at the end of block 99 of disk 0 and the start of disk 1. It
+ * also checks that the volume ends where its geometry says and that
+ * geometries the device cannot hold are refused.
+ */
+int test_mount_geometry() {
+  printf("running %s: ", __func__);
+
+  mdadm_geometry_t small = { 3, 100, JBOD_BLOCK_SIZE, 0 }, g;
+  mdadm_geometry_t too_many_disks = { JBOD_NUM_DISKS + 1, 100, JBOD_BLOCK_SIZE, 0 };
+  mdadm_geometry_t empty_disks = { 3, 0, JBOD_BLOCK_SIZE, 0 };
+  mdadm_geometry_t big_blocks = { 3, 100, 2 * JBOD_BLOCK_SIZE, 0 };
+  mdadm_geometry_t ragged_stripes = { 3, 100, JBOD_BLOCK_SIZE, 3 };
+  uint8_t in[SIZE], out[SIZE];
+  uint32_t boundary = 100 * JBOD_BLOCK_SIZE;
+  bool success = false;
+
+  if (mdadm_mount_geometry(&too_many_disks) != -1 || mdadm_mount_geometry(&empty_disks) != -1 ||
+      mdadm_mount_geometry(&big_blocks) != -1 || mdadm_mount_geometry(&ragged_stripes) != -1) {
+    printf("failed: geometries that do not fit the device should not mount.\n");
+    mdadm_unmount();
+    return 0;
+  }
+  if (mdadm_mount_geometry(&small) != 1) {
+    printf("failed: a volume of 3 disks of 100 blocks should mount.\n");
+    return 0;
+  }
+  mdadm_get_geometry(&g);
+  if (g.num_disks != 3 || g.blocks_per_disk != 100 || g.stripe_blocks != 0) {
+    printf("failed: the mounted geometry should be 3 linear disks of 100 blocks.\n");
+    goto out;
+  }
+  mdadm_write_permission();
+  for (int i = 0; i < SIZE; ++i)
+    in[i] = 0x40 + i;
+  if (mdadm_write(boundary - SIZE / 2, SIZE, in) != SIZE) {
+    printf("failed: writing across the first disk boundary failed.\n");
+    goto out;
+  }
+  if (mdadm_read(3 * boundary - 1, 2, out) != -1 || mdadm_read(3 * boundary - 2, 2, out) != 2) {
+    printf("failed: the volume should end after 3 disks of 100 blocks.\n");
+    goto out;
+  }
+
+  /* Straight from the device; this loses mdadm's idea of where the head is,
+   * which unmounting resets. */
+  uint8_t block[JBOD_BLOCK_SIZE];
+  if (raw_read_block(0, 99, block) != 0 ||
+      memcmp(block + JBOD_BLOCK_SIZE - SIZE / 2, in, SIZE / 2) != 0 ||
+      raw_read_block(1, 0, block) != 0 || memcmp(block, in + SIZE / 2, SIZE / 2) != 0) {
+    printf("failed: the write should have gone to the end of disk 0 and the start of disk 1.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test mounts five disks of 100 blocks striped in units of two blocks,
+ * writes a range crossing from one row of stripes into the next through the
+ * per-disk I/O queues, reads it back both ways and checks on the device that
+ * each block landed on the disk and block its stripe unit rotates it to, and
+ * that a readv over the stripes visits the disks in device order.
+ */
+int test_mount_striped() {
+  printf("running %s: ", __func__);
+
+  mdadm_geometry_t striped = { 5, 100, JBOD_BLOCK_SIZE, 2 }, g;
+  uint8_t in[MAX_IO_SIZE], out[MAX_IO_SIZE], block[JBOD_BLOCK_SIZE];
+  uint32_t addr = 8 * JBOD_BLOCK_SIZE + 10;
+  bool success = false;
+
+  if (mdadm_mount_geometry(&striped) != 1) {
+    printf("failed: a volume of 5 disks striped in units of 2 blocks should mount.\n");
+    return 0;
+  }
+  mdadm_get_geometry(&g);
+  if (g.num_disks != 5 || g.blocks_per_disk != 100 || g.stripe_blocks != 2) {
+    printf("failed: the mounted geometry should be 5 disks in stripes of 2 blocks.\n");
+    goto out;
+  }
+  mdadm_write_permission();
+  for (int i = 0; i < MAX_IO_SIZE; ++i)
+    in[i] = i * 13 + 5;
+  if (mdadm_set_io_queues(true) != 1 || mdadm_write(addr, MAX_IO_SIZE, in) != MAX_IO_SIZE ||
+      mdadm_read(addr, MAX_IO_SIZE, out) != MAX_IO_SIZE || memcmp(in, out, MAX_IO_SIZE) != 0) {
+    printf("failed: queued I/O across stripes should read back what was written.\n");
+    goto out;
+  }
+  mdadm_set_io_queues(false);
+  memset(out, 0, sizeof(out));
+  if (mdadm_read(addr, MAX_IO_SIZE, out) != MAX_IO_SIZE || memcmp(in, out, MAX_IO_SIZE) != 0) {
+    printf("failed: direct I/O across stripes should read back what was written.\n");
+    goto out;
+  }
+  if (mdadm_read(5 * 100 * JBOD_BLOCK_SIZE - 1, 2, out) != -1) {
+    printf("failed: the volume should end after 5 disks of 100 blocks.\n");
+    goto out;
+  }
+
+  /* Volume blocks 8 to 12 are units 4 to 6: disk 4 of row 0, then disks 0
+   * and 1 of row 1. */
+  static const int where[][2] = { { 4, 0 }, { 4, 1 }, { 0, 2 }, { 0, 3 }, { 1, 2 } };
+  for (int i = 0; i < 5; ++i) {
+    uint32_t start = (8 + i) * JBOD_BLOCK_SIZE;
+    uint32_t from = start > addr ? start : addr;
+    uint32_t to = start + JBOD_BLOCK_SIZE < addr + MAX_IO_SIZE ? start + JBOD_BLOCK_SIZE :
+                                                                addr + MAX_IO_SIZE;
+    if (raw_read_block(where[i][0], where[i][1], block) != 0 ||
+        memcmp(block + (from - start), in + (from - addr), to - from) != 0) {
+      printf("failed: volume block %d should be block %d of disk %d.\n", 8 + i, where[i][1],
+             where[i][0]);
+      goto out;
+    }
+  }
+
+  /* Volume blocks 0 to 19 are two rows of stripes, so in address order a
+   * readv of one segment per block visits every disk twice; in device order
+   * it needs one seek per disk. */
+  mdadm_iovec_t iov[20];
+  mdadm_stats_t st;
+  for (int i = 0; i < 20; ++i)
+    iov[i] = (mdadm_iovec_t){ i * JBOD_BLOCK_SIZE, 16, out + i * 16 };
+  mdadm_reset_stats();
+  if (mdadm_readv(iov, 20) != 20 * 16) {
+    printf("failed: a readv across two rows of stripes failed.\n");
+    goto out;
+  }
+  mdadm_get_stats(&st);
+  if (st.jbod_ops[JBOD_SEEK_TO_DISK] > 5) {
+    printf("failed: a readv over 5 disks should seek to each once, not %llu times in all.\n",
+           (unsigned long long)st.jbod_ops[JBOD_SEEK_TO_DISK]);
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_set_io_queues(false);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test converts a small text trace into a binary one, maps it and
+ * checks that every command came through, then checks that a line that is
+ * not a command is rejected.
+ */
+int test_binary_trace() {
+  printf("running %s: ", __func__);
+
+  static const char *lines[] = {
+    "MOUNT", "WRITE_PERMIT", "WRITE 1000 300 171", "READ 65530 12 0",
+    "SIGNALL", "WRITE_PERMIT_REVOKE", "UNMOUNT",
+  };
+  static const trace_record_t expected[] = {
+    { TRACE_MOUNT }, { TRACE_WRITE_PERMIT }, { TRACE_WRITE, 171, 300, 1000 },
+    { TRACE_READ, 0, 12, 65530 }, { TRACE_SIGNALL }, { TRACE_WRITE_PERMIT_REVOKE },
+    { TRACE_UNMOUNT },
+  };
+  int n = sizeof(lines) / sizeof(lines[0]);
+  char text_file[] = "/tmp/tester-trace-XXXXXX";
+  char binary_file[64];
+  bool success = false;
+  trace_map_t t = { 0 };
+  trace_record_t rec;
+
+  int fd = mkstemp(text_file);
+  if (fd == -1) {
+    printf("failed: cannot create a temporary file.\n");
+    return 0;
+  }
+  FILE *f = fdopen(fd, "w");
+  for (int i = 0; i < n; ++i)
+    fprintf(f, "%s\n", lines[i]);
+  fclose(f);
+  snprintf(binary_file, sizeof(binary_file), "%s.bin", text_file);
+
+  if (trace_convert(text_file, binary_file) != n) {
+    printf("failed: converting the trace should write %d records.\n", n);
+    goto out;
+  }
+  if (trace_map(text_file, &t) != 0) {
+    printf("failed: a text trace should not map as a binary one.\n");
+    goto out;
+  }
+  if (trace_map(binary_file, &t) != 1 || t.num_records != n) {
+    printf("failed: the binary trace should map with %d records.\n", n);
+    goto out;
+  }
+  for (int i = 0; i < n; ++i) {
+    if (memcmp(&t.records[i], &expected[i], sizeof(rec)) != 0) {
+      printf("failed: record %d does not match [%s].\n", i, lines[i]);
+      goto out;
+    }
+  }
+  if (trace_parse_line("WRITE 1 2", &rec) != -1 || trace_parse_line("MOUNTED", &rec) != -1) {
+    printf("failed: malformed lines should not parse.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  trace_unmap(&t);
+  unlink(text_file);
+  unlink(binary_file);
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test checks the block kernels against memcpy, memset and memcmp on
+ * misaligned buffers, with a difference at every position of the block, and
+ * the address helpers against division.
+ */
+int test_block_kernels() {
+  printf("running %s: ", __func__);
+
+  uint8_t a[JBOD_BLOCK_SIZE + 1], b[JBOD_BLOCK_SIZE + 1], c[MAX_IO_SIZE + 1];
+
+  for (int i = 0; i <= JBOD_BLOCK_SIZE; ++i)
+    a[i] = get_rand(0, 255);
+  block_copy(b + 1, a + 1);
+  if (memcmp(a + 1, b + 1, JBOD_BLOCK_SIZE) != 0 || !block_equal(a + 1, b + 1)) {
+    printf("failed: a copied block should be equal to the original (%s).\n", block_kernels());
+    return 0;
+  }
+  for (int i = 1; i <= JBOD_BLOCK_SIZE; ++i) {
+    b[i] ^= 0x80;
+    bool equal = block_equal(a + 1, b + 1);
+    b[i] ^= 0x80;
+    if (equal) {
+      printf("failed: blocks differing at byte %d should not be equal (%s).\n", i - 1,
+             block_kernels());
+      return 0;
+    }
+  }
+  for (int len = 0; len <= MAX_IO_SIZE; len += 1 + len / 8) {
+    memset(c, 0x11, sizeof(c));
+    block_fill(c + 1, 0xee, len);
+    for (int i = 0; i <= MAX_IO_SIZE; ++i) {
+      if (c[i] != (i >= 1 && i <= len ? 0xee : 0x11)) {
+        printf("failed: filling %d bytes set byte %d wrong (%s).\n", len, i, block_kernels());
+        return 0;
+      }
+    }
+  }
+
+  /* The shift paths for whole disks and stripes of powers of two, and the
+   * division paths for everything else. */
+  static const uint32_t shapes[][3] = {
+    { JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK, 0 }, { JBOD_NUM_DISKS, 100, 0 },
+    { JBOD_NUM_DISKS, JBOD_NUM_BLOCKS_PER_DISK, 4 }, { 5, 100, 2 }, { 3, 99, 3 },
+  };
+  for (size_t n = 0; n < sizeof(shapes) / sizeof(shapes[0]); ++n) {
+    uint32_t disks = shapes[n][0], blocks = shapes[n][1], stripe = shapes[n][2];
+    uint32_t disk_size = blocks * JBOD_BLOCK_SIZE;
+    uint32_t run = stripe ? stripe * JBOD_BLOCK_SIZE : disk_size;
+    block_geometry_t g;
+    block_geometry_init(&g, disks, blocks, stripe);
+    for (int i = 0; i < 1000; ++i) {
+      uint32_t addr = get_rand(0, disks * disk_size - 1), disk, block;
+      if (stripe) {
+        uint32_t unit = addr / JBOD_BLOCK_SIZE / stripe;
+        disk = unit % disks;
+        block = unit / disks * stripe + addr / JBOD_BLOCK_SIZE % stripe;
+      } else {
+        disk = addr / disk_size;
+        block = addr % disk_size / JBOD_BLOCK_SIZE;
+      }
+      uint32_t key = block_key(disk, block);
+      if (addr_disk(&g, addr) != disk || addr_block(&g, addr) != block ||
+          addr_offset(addr) != addr % JBOD_BLOCK_SIZE || key_disk(key) != disk ||
+          key_block(key) != block || addr_run_start(&g, addr) != addr / run * run ||
+          addr_run_end(&g, addr) != addr / run * run + run) {
+        printf("failed: address %u is split wrong for %u disks of %u blocks in stripes of %u.\n",
+               addr, disks, blocks, stripe);
+        return 0;
+      }
+    }
+  }
+
+  printf("passed\n");
+  return 1;
+}
+
+#define LOG_THREADS 4
+#define LOG_MESSAGES 1000
+
+static void *log_worker(void *arg) {
+  for (int i = 0; i < LOG_MESSAGES; ++i)
+    debug_log("thread %d message %d", (int)(intptr_t)arg, i);
+  return NULL;
+}
+
+/*
+ * This test logs from several threads at once through the asynchronous sink
+ * and checks that after a flush every message is in the log file, whole and
+ * on a line of its own.
+ */
+int test_async_log() {
+  printf("running %s: ", __func__);
+
+  char log_file[] = "/tmp/tester-log-XXXXXX";
+  char line[256];
+  pthread_t threads[LOG_THREADS];
+  int lines = 0, bad = 0;
+
+  int fd = mkstemp(log_file);
+  if (fd == -1) {
+    printf("failed: cannot create a temporary file.\n");
+    return 0;
+  }
+  close(fd);
+  set_debug_logfile(log_file);
+  enable_async_debug_log();
+  enable_debug_log();
+  for (int t = 0; t < LOG_THREADS; ++t)
+    pthread_create(&threads[t], NULL, log_worker, (void *)(intptr_t)t);
+  for (int t = 0; t < LOG_THREADS; ++t)
+    pthread_join(threads[t], NULL);
+  flush_debug_log();
+  disable_debug_log();
+  disable_async_debug_log();
+
+  FILE *f = fopen(log_file, "r");
+  while (f && fgets(line, sizeof(line), f)) {
+    int t, i;
+    ++lines;
+    if (sscanf(line, "thread %d message %d\n", &t, &i) != 2 || line[strlen(line) - 1] != '\n')
+      ++bad;
+  }
+  if (f)
+    fclose(f);
+  unlink(log_file);
+
+  if (bad || lines != LOG_THREADS * LOG_MESSAGES) {
+    printf("failed: %d lines, %d malformed, out of %d messages.\n",
+           lines, bad, LOG_THREADS * LOG_MESSAGES);
+    return 0;
+  }
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test seeds the generator twice with the same seed and checks that it
+ * repeats itself, that another seed does not, and that get_rand stays within
+ * its bounds, including the full 32-bit range.
+ */
+int test_rand_seed() {
+  printf("running %s: ", __func__);
+
+  uint64_t first[8];
+  bool differs = false;
+
+  rand_seed(42);
+  for (int i = 0; i < 8; ++i)
+    first[i] = rand_u64();
+  rand_seed(42);
+  for (int i = 0; i < 8; ++i) {
+    if (rand_u64() != first[i]) {
+      printf("failed: the same seed should give the same numbers.\n");
+      return 0;
+    }
+  }
+  rand_seed(43);
+  for (int i = 0; i < 8; ++i)
+    differs |= rand_u64() != first[i];
+  if (!differs) {
+    printf("failed: another seed should give other numbers.\n");
+    return 0;
+  }
+
+  for (int i = 0; i < 10000; ++i) {
+    uint32_t v = get_rand(10, 13);
+    double d = rand_double();
+    if (v < 10 || v > 13 || d < 0 || d >= 1) {
+      printf("failed: %u or %f is out of range.\n", v, d);
+      return 0;
+    }
+  }
+  get_rand(0, UINT32_MAX);
+
+  printf("passed\n");
+  return 1;
+}
+
+#define POOL_THREADS 4
+#define POOL_ROUNDS 10000
+#define POOL_HELD 8
+
+static void *pool_worker(void *arg) {
+  pool_t *pool = arg;
+  void *held[POOL_HELD];
+  for (int i = 0; i < POOL_ROUNDS; ++i) {
+    for (int j = 0; j < POOL_HELD; ++j) {
+      held[j] = pool_get(pool);
+      if (!held[j])
+        return arg;
+      memset(held[j], j, 100);
+    }
+    for (int j = 0; j < POOL_HELD; ++j) {
+      if (((uint8_t *)held[j])[99] != j)
+        return arg;
+      pool_put(pool, held[j]);
+    }
+  }
+  return NULL;
+}
+
+/* Leaves an object in its stash for a pool that is destroyed and freed
+ * before the thread exits. */
+static void *pool_late_exit_worker(void *arg) {
+  pool_t *pool = ((void **)arg)[0];
+  pthread_barrier_t *barrier = ((void **)arg)[1];
+  pool_put(pool, pool_get(pool));
+  pthread_barrier_wait(barrier);
+  pthread_barrier_wait(barrier);
+  return NULL;
+}
+
+/*
+ * This test takes objects from a pool and checks that they are aligned and
+ * distinct, then has several threads take and give back objects over and
+ * over, and checks that once the pool is warm no more slabs are mapped. Then
+ * it checks that destroyed pools give their stash slots to later ones, and
+ * that a thread may exit after a pool it used is gone.
+ */
+int test_pool() {
+  printf("running %s: ", __func__);
+
+  pool_t pool;
+  void *objs[100];
+  pthread_t threads[POOL_THREADS];
+  bool success = false;
+
+  pool_init(&pool, 100, 4096);
+  for (int i = 0; i < 100; ++i) {
+    objs[i] = pool_get(&pool);
+    if (!objs[i] || (uintptr_t)objs[i] % POOL_ALIGN != 0) {
+      printf("failed: object %d is missing or not aligned.\n", i);
+      goto out;
+    }
+    memset(objs[i], i, 100);
+  }
+  for (int i = 0; i < 100; ++i) {
+    if (((uint8_t *)objs[i])[0] != i || ((uint8_t *)objs[i])[99] != i) {
+      printf("failed: object %d was handed out twice.\n", i);
+      goto out;
+    }
+  }
+  for (int i = 0; i < 100; ++i)
+    pool_put(&pool, objs[i]);
+
+  size_t warm = 0;
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < POOL_THREADS; ++i)
+      pthread_create(&threads[i], NULL, pool_worker, &pool);
+    bool failed = false;
+    for (int i = 0; i < POOL_THREADS; ++i) {
+      void *rc;
+      pthread_join(threads[i], &rc);
+      failed |= rc != NULL;
+    }
+    if (failed) {
+      printf("failed: a thread got no object or one another thread was using.\n");
+      goto out;
+    }
+    if (round == 0) {
+      warm = pool_num_slabs(&pool);
+    } else if (pool_num_slabs(&pool) != warm) {
+      printf("failed: a warm pool mapped %zu slabs instead of %zu.\n",
+             pool_num_slabs(&pool), warm);
+      goto out;
+    }
+  }
+
+  for (int i = 0; i < 2 * POOL_MAX_POOLS; ++i) {
+    pool_t short_lived;
+    pool_init(&short_lived, 64, 4096);
+    pool_put(&short_lived, pool_get(&short_lived));
+    bool stashed = short_lived.id >= 0 && short_lived.id < POOL_MAX_POOLS;
+    pool_destroy(&short_lived);
+    if (!stashed) {
+      printf("failed: pool %d got no stash slot though earlier ones were destroyed.\n", i);
+      goto out;
+    }
+  }
+
+  pool_t *heap_pool = malloc(sizeof(*heap_pool));
+  pthread_barrier_t barrier;
+  void *late_args[2] = { heap_pool, &barrier };
+  pthread_t late;
+  pool_init(heap_pool, 64, 4096);
+  pthread_barrier_init(&barrier, NULL, 2);
+  pthread_create(&late, NULL, pool_late_exit_worker, late_args);
+  pthread_barrier_wait(&barrier);
+  pool_destroy(heap_pool);
+  free(heap_pool);
+  pthread_barrier_wait(&barrier);
+  pthread_join(late, NULL);
+  pthread_barrier_destroy(&barrier);
+  success = true;
+
+out:
+  pool_destroy(&pool);
+  if (pool_num_slabs(&pool) != 0) {
+    printf("failed: a destroyed pool should have no slabs.\n");
+    return 0;
+  }
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+#define NUM_TEST_KEYS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+/*
+ * This test brings the signatures up to date after mounting, which rehashes
+ * every block, then writes one block and checks that only that block is
+ * rehashed, that it now signs like a block with the same contents, and that
+ * its disk's and the volume's signatures change while other disks' do not.
+ * A block rewritten through the cache is then rehashed from the cache,
+ * without a device read or a cache lookup.
+ */
+int test_signatures() {
+  printf("running %s: ", __func__);
+
+  bool success = false;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  uint8_t a[MDADM_SIG_SIZE], b[MDADM_SIG_SIZE];
+  uint8_t disk0[MDADM_SIG_SIZE], disk1[MDADM_SIG_SIZE], volume[MDADM_SIG_SIZE];
+  cache_stats_t before, after;
+  mdadm_stats_t st;
+
+  mdadm_mount();
+  mdadm_write_permission();
+  memset(buf, 0x5a, sizeof(buf));
+
+  if (mdadm_block_signature(0, 0, a) != -1) {
+    printf("failed: signatures should not be available before an update.\n");
+    goto out;
+  }
+  if (mdadm_write(5 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE ||
+      mdadm_update_signatures(4) != NUM_TEST_KEYS) {
+    printf("failed: the first update should rehash all %d blocks.\n", NUM_TEST_KEYS);
+    goto out;
+  }
+  if (mdadm_update_signatures(4) != 0) {
+    printf("failed: an update without writes should rehash nothing.\n");
+    goto out;
+  }
+  mdadm_disk_signature(0, disk0);
+  mdadm_disk_signature(1, disk1);
+  mdadm_volume_signature(volume);
+
+  if (mdadm_write(9 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE ||
+      mdadm_update_signatures(4) != 1) {
+    printf("failed: an update after a one-block write should rehash one block.\n");
+    goto out;
+  }
+  mdadm_block_signature(0, 5, a);
+  mdadm_block_signature(0, 9, b);
+  if (memcmp(a, b, MDADM_SIG_SIZE) != 0) {
+    printf("failed: blocks with the same contents should sign the same.\n");
+    goto out;
+  }
+  mdadm_disk_signature(0, a);
+  mdadm_disk_signature(1, b);
+  if (memcmp(a, disk0, MDADM_SIG_SIZE) == 0 || memcmp(b, disk1, MDADM_SIG_SIZE) != 0) {
+    printf("failed: only the written disk's signature should change.\n");
+    goto out;
+  }
+  mdadm_volume_signature(a);
+  if (memcmp(a, volume, MDADM_SIG_SIZE) == 0) {
+    printf("failed: the volume signature should change.\n");
+    goto out;
+  }
+
+  // A cached block is rehashed from the cache without counting as a lookup
+  cache_create(4);
+  memset(buf, 0x3c, sizeof(buf));
+  if (mdadm_write(9 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE) {
+    printf("failed: write failed\n");
+    goto out;
+  }
+  mdadm_reset_stats();
+  cache_get_stats(&before);
+  if (mdadm_update_signatures(4) != 1) {
+    printf("failed: an update after a one-block write should rehash one block.\n");
+    goto out;
+  }
+  cache_get_stats(&after);
+  mdadm_get_stats(&st);
+  if (st.jbod_ops[JBOD_READ_BLOCK] != 0) {
+    printf("failed: a cached block should not be reread from the device.\n");
+    goto out;
+  }
+  if (after.queries != before.queries || after.hits != before.hits) {
+    printf("failed: rehashing should not count as cache lookups.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  cache_destroy();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test saves a cache holding blocks 0 to 3 of disk 2, then changes
+ * block 1 on the device with no cache in the way. Loading the snapshot
+ * through mdadm must bring back the other three blocks and leave the stale
+ * one out, so that a read sees the device's new data.
+ */
+int test_load_cache() {
+  printf("running %s: ", __func__);
+
+  bool success = false;
+  char path[] = "/tmp/tester-snapshot-XXXXXX";
+  uint8_t in[JBOD_BLOCK_SIZE], out[JBOD_BLOCK_SIZE];
+  uint32_t disk2 = 2 * JBOD_DISK_SIZE;
+
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    printf("failed: cannot create a temporary file.\n");
+    return 0;
+  }
+  close(fd);
+
+  mdadm_mount();
+  mdadm_write_permission();
+  cache_create_with_policy(4, CACHE_POLICY_LRU);
+  for (int block = 0; block < 4; ++block) {
+    memset(in, block + 1, JBOD_BLOCK_SIZE);
+    if (mdadm_write(disk2 + block * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, in) != JBOD_BLOCK_SIZE) {
+      printf("failed: write failed\n");
+      goto out;
+    }
+  }
+  if (cache_save(path) != 4) {
+    printf("failed: saving a full cache of 4 blocks should save 4 blocks.\n");
+    goto out;
+  }
+  cache_destroy();
+
+  memset(in, 0xaa, JBOD_BLOCK_SIZE);
+  if (mdadm_write(disk2 + JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, in) != JBOD_BLOCK_SIZE) {
+    printf("failed: write failed\n");
+    goto out;
+  }
+
+  cache_create_with_policy(8, CACHE_POLICY_LRU);
+  if (mdadm_load_cache(path) != 3 || cache_contains(2, 1) || !cache_contains(2, 3)) {
+    printf("failed: a block changed on the device since the save should not be loaded.\n");
+    goto out;
+  }
+  if (mdadm_read(disk2 + JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE ||
+      memcmp(out, in, JBOD_BLOCK_SIZE) != 0) {
+    printf("failed: a read should see the device's new data, not the snapshot's.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  cache_destroy();
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  unlink(path);
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_BLOCKS 64
+
+/* Each thread owns one disk. It fills the first CONCURRENT_BLOCKS blocks with
+ * a value of its own, half a block per write so that every write needs the
+ * block's current contents, and then reads them back. */
+static void *concurrent_io_worker(void *arg) {
+  int t = (int)(intptr_t)arg;
+  uint8_t half[JBOD_BLOCK_SIZE / 2], out[JBOD_BLOCK_SIZE];
+
+  for (int b = 0; b < CONCURRENT_BLOCKS; ++b) {
+    uint32_t addr = t * JBOD_DISK_SIZE + b * JBOD_BLOCK_SIZE;
+    memset(half, t * CONCURRENT_BLOCKS + b, sizeof(half));
+    if (mdadm_write(addr, sizeof(half), half) != sizeof(half) ||
+        mdadm_write(addr + sizeof(half), sizeof(half), half) != sizeof(half))
+      return (void *)1;
+  }
+  for (int b = 0; b < CONCURRENT_BLOCKS; ++b) {
+    uint32_t addr = t * JBOD_DISK_SIZE + b * JBOD_BLOCK_SIZE;
+    if (mdadm_read(addr, JBOD_BLOCK_SIZE, out) != JBOD_BLOCK_SIZE)
+      return (void *)1;
+    for (int i = 0; i < JBOD_BLOCK_SIZE; ++i)
+      if (out[i] != (uint8_t)(t * CONCURRENT_BLOCKS + b))
+        return (void *)1;
+  }
+  return NULL;
+}
+
+/*
+ * This test runs CONCURRENT_THREADS threads that read and write their own
+ * disks at the same time through a sharded cache smaller than their working
+ * set. Every thread must read back what it wrote.
+ */
+int test_concurrent_io() {
+  printf("running %s: ", __func__);
+
+  cache_create_sharded(64, CACHE_POLICY_LRU, 4);
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = true;
+  pthread_t threads[CONCURRENT_THREADS];
+  for (int t = 0; t < CONCURRENT_THREADS; ++t)
+    pthread_create(&threads[t], NULL, concurrent_io_worker, (void *)(intptr_t)t);
+  for (int t = 0; t < CONCURRENT_THREADS; ++t) {
+    void *rc;
+    pthread_join(threads[t], &rc);
+    if (rc != NULL)
+      success = false;
+  }
+
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  cache_destroy();
+  if (!success) {
+    printf("failed: a thread did not read back what it wrote.\n");
+    return 0;
+  }
+
+  printf("passed\n");
+  return 1;
+}
+
+/*
+ * This test writes and reads back a range that spans the end of disk 0 and
+ * the start of disk 1 with the per-disk I/O queues running, so that each
+ * request is split into one sub-request per disk.
+ */
+int test_io_queues_across_disks() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = false;
+  uint8_t in[SIZE], out[SIZE];
+  for (int i = 0; i < SIZE; ++i)
+    in[i] = i * 7 + 1;
+
+  if (mdadm_set_io_queues(true) != 1) {
+    printf("failed: starting the I/O queues should succeed but it failed.\n");
+    goto out;
+  }
+
+  uint32_t addr = JBOD_DISK_SIZE - SIZE / 2;
+  if (mdadm_write(addr, SIZE, in) != SIZE || mdadm_read(addr, SIZE, out) != SIZE) {
+    printf("failed: queued I/O failed\n");
+    goto out;
+  }
+
+  if (memcmp(in, out, SIZE) != 0) {
+    char *out_s = stringify(out, SIZE);
+    char *expected_s = stringify(in, SIZE);
+
+    printf("failed:\n  got:      %s\n  expected: %s\n", out_s, expected_s);
+
+    free(out_s);
+    free(expected_s);
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_set_io_queues(false);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+#define ASYNC_DEPTH 8
+
+/*
+ * This test keeps ASYNC_DEPTH asynchronous writes, each to a block of its own
+ * on a different disk, in flight at once, checks that one more is refused,
+ * then reads the blocks back asynchronously, reaping the reads by polling.
+ */
+int test_async_io() {
+  printf("running %s: ", __func__);
+
+  mdadm_mount();
+  mdadm_write_permission();
+
+  bool success = false;
+  int tickets[ASYNC_DEPTH];
+  uint8_t in[ASYNC_DEPTH][JBOD_BLOCK_SIZE], out[ASYNC_DEPTH][JBOD_BLOCK_SIZE];
+
+  if (mdadm_set_queue_depth(ASYNC_DEPTH) != 1 || mdadm_set_io_queues(true) != 1) {
+    printf("failed: setting up the I/O queues should succeed but it failed.\n");
+    goto out;
+  }
+
+  for (int i = 0; i < ASYNC_DEPTH; ++i) {
+    memset(in[i], 0x30 + i, JBOD_BLOCK_SIZE);
+    tickets[i] = mdadm_submit_write(i * JBOD_DISK_SIZE + 3 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, in[i]);
+    if (tickets[i] < 0) {
+      printf("failed: submitting write %d failed (%d).\n", i, tickets[i]);
+      goto out;
+    }
+  }
+  if (mdadm_submit_read(0, JBOD_BLOCK_SIZE, out[0]) != -6) {
+    printf("failed: a submission beyond the queue depth should be refused.\n");
+    goto out;
+  }
+  for (int i = 0; i < ASYNC_DEPTH; ++i) {
+    if (mdadm_wait(tickets[i]) != JBOD_BLOCK_SIZE) {
+      printf("failed: write %d failed\n", i);
+      goto out;
+    }
+  }
+  if (mdadm_wait(tickets[0]) != -4) {
+    printf("failed: a reaped ticket should not be waited for again.\n");
+    goto out;
+  }
+
+  for (int i = 0; i < ASYNC_DEPTH; ++i) {
+    tickets[i] = mdadm_submit_read(i * JBOD_DISK_SIZE + 3 * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, out[i]);
+    if (tickets[i] < 0) {
+      printf("failed: submitting read %d failed (%d).\n", i, tickets[i]);
+      goto out;
+    }
+  }
+  for (int i = 0; i < ASYNC_DEPTH; ++i) {
+    int rc, result;
+    while ((rc = mdadm_poll(tickets[i], &result)) == 0)
+      ;
+    if (rc != 1 || result != JBOD_BLOCK_SIZE) {
+      printf("failed: read %d failed\n", i);
+      goto out;
+    }
+  }
+
+  if (memcmp(in, out, sizeof(in)) != 0) {
+    printf("failed: asynchronous reads did not return what was written.\n");
+    goto out;
+  }
+  success = true;
+
+out:
+  mdadm_set_io_queues(false);
+  mdadm_set_queue_depth(64);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (!success)
+    return 0;
+
+  printf("passed\n");
+  return 1;
+}
+
+/* State of one workload replay. In batch mode reads and writes are queued
+ * up, each with a buffer of its own, and run together before the next
+ * command of any other kind. */
+typedef struct {
+  uint8_t buf[MAX_IO_SIZE];
+  uint8_t write_buf[MAX_IO_SIZE];
+  uint32_t write_filled;  /* write_buf starts with this many bytes of write_fill */
+  uint8_t write_fill;
+  mdadm_batch_op_t *batch;
+  uint8_t *batch_bufs;
+  int batch_size;
+  int batch_len;
+} workload_t;
+
+static int flush_batch(workload_t *w) {
+  int rc = 0;
+  if (w->batch_len > 0)
+    rc = mdadm_run_batch(w->batch, w->batch_len);
+  w->batch_len = 0;
+  return rc;
+}
+
+/* Runs one trace command; returns -1 if it (or the batch before it) failed. */
+static int run_record(workload_t *w, const trace_record_t *rec) {
+  if (rec->op != TRACE_READ && rec->op != TRACE_WRITE && flush_batch(w) == -1)
+    return -1;
+
+  switch (rec->op) {
+    case TRACE_MOUNT:
+      return mdadm_mount();
+    case TRACE_UNMOUNT:
+      return mdadm_unmount();
+    case TRACE_WRITE_PERMIT:
+      return mdadm_write_permission();
+    case TRACE_WRITE_PERMIT_REVOKE:
+      return mdadm_revoke_write_permission();
+    case TRACE_SIGNALL:
+      /* Signatures are taken from the device, so dirty blocks go first. The
+       * JBOD signs blocks for free, whereas mdadm_update_signatures would
+       * charge the trace for reading every block after mounting. */
+      mdadm_flush();
+      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
+        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j)
+          jbod_sign_block(i, j);
+      return 0;
+    case TRACE_READ:
+    case TRACE_WRITE:
+      break;
+    default:
+      return -1;
+  }
+
+  bool write = rec->op == TRACE_WRITE;
+  if (w->batch) {
+    if (rec->len > MAX_IO_SIZE)
+      return -1;
+    mdadm_batch_op_t *op = &w->batch[w->batch_len];
+    op->write = write;
+    op->addr = rec->addr;
+    op->len = rec->len;
+    op->buf = w->batch_bufs + w->batch_len * MAX_IO_SIZE;
+    if (write)
+      block_fill(op->buf, rec->fill, rec->len);
+    if (++w->batch_len == w->batch_size)
+      return flush_batch(w);
+    return 0;
+  }
+  if (!write)
+    return mdadm_read(rec->addr, rec->len, w->buf);
+  if (rec->len > MAX_IO_SIZE)
+    return -1;
+  /* Runs of writes with the same fill byte reuse the buffer as it is. */
+  if (rec->fill != w->write_fill || rec->len > w->write_filled) {
+    block_fill(w->write_buf, rec->fill, rec->len);
+    w->write_fill = rec->fill;
+    w->write_filled = rec->len;
+  }
+  return mdadm_write(rec->addr, rec->len, w->write_buf);
+}
+
+int run_workload(char *workload, int cache_size, cache_policy_t policy, bool admission,
+                 bool write_back, int read_ahead, bool io_queues, int batch_size,
+                 const char *stats_file) {
+  char line[256];
+  static workload_t w;
+  trace_map_t trace;
+  trace_record_t rec;
+  FILE *f = NULL;
+  int rc;
+
+  memset(&w, 0, sizeof(w));
+  if (batch_size < 0)
+    errx(1, "Invalid batch size (%d).", batch_size);
+  if (batch_size) {
+    w.batch_size = batch_size;
+    w.batch = malloc(sizeof(*w.batch) * batch_size);
+    w.batch_bufs = malloc((size_t)batch_size * MAX_IO_SIZE);
+    if (!w.batch || !w.batch_bufs)
+      errx(1, "Failed to allocate the batch.");
+  }
+
+  /* Binary traces are replayed straight from the mapping; anything else is
+   * parsed as a text trace one line at a time. */
+  rc = trace_map(workload, &trace);
+  if (rc == -1)
+    err(1, "Cannot open workload file %s", workload);
+  if (rc == 0) {
+    f = fopen(workload, "r");
+    if (!f)
+      err(1, "Cannot open workload file %s", workload);
+  }
+
+  if (cache_size) {
+    rc = cache_create_with_policy(cache_size, policy);
+    if (rc != 1)
+      errx(1, "Failed to create cache.");
+    if (admission && cache_set_admission(true) != 1)
+      errx(1, "Failed to enable the admission filter.");
+    if (write_back && mdadm_set_write_back(true) != 1)
+      errx(1, "Failed to enable write-back caching.");
+  }
+  if (read_ahead && mdadm_set_read_ahead(read_ahead) != 1)
+    errx(1, "Invalid read-ahead window (%d).", read_ahead);
+  if (io_queues && mdadm_set_io_queues(true) != 1)
+    errx(1, "Failed to start the I/O queues.");
+
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  uint64_t commands = 0;
+  if (f) {
+    while (fgets(line, 256, f)) {
+      ++commands;
+      line[strlen(line)-1] = '\0';
+      if (trace_parse_line(line, &rec) != 1)
+        errx(1, "Failed to parse command [%s] on line %" PRIu64 ", aborting.", line, commands);
+      if (run_record(&w, &rec) == -1)
+        errx(1, "tester failed when processing command [%s] on line %" PRIu64 "", line, commands);
+    }
+    fclose(f);
+  } else {
+    for (; commands < trace.num_records; ++commands)
+      if (run_record(&w, &trace.records[commands]) == -1)
+        errx(1, "tester failed when processing record %" PRIu64, commands);
+    trace_unmap(&trace);
+  }
+  if (flush_batch(&w) == -1)
+    errx(1, "tester failed when processing the last batch");
+  free(w.batch);
+  free(w.batch_bufs);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+  jbod_print_cost();
+  cache_print_hit_rate();
+  if (stats_file) {
+    FILE *sf = fopen(stats_file, "w");
+    if (!sf || mdadm_dump_stats(sf) != 1)
+      err(1, "Cannot write statistics to %s", stats_file);
+    fprintf(sf, "workload.commands %" PRIu64 "\n", commands);
+    fprintf(sf, "workload.seconds %.6f\n", seconds);
+    fclose(sf);
+  }
+
+  if (cache_size)
+    cache_destroy();
+  mdadm_set_read_ahead(0);
+  mdadm_set_io_queues(false);
 
   return 0;
 }
@@ -0,0 +1,162 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/* Text names of the commands, in trace_op_t order. */
+static const char *trace_op_names[TRACE_NUM_OPS] = {
+  "MOUNT", "UNMOUNT", "WRITE_PERMIT", "WRITE_PERMIT_REVOKE", "SIGNALL",
+  "READ", "WRITE",
+};
+
+int trace_parse_line(const char *line, trace_record_t *rec) {
+  char cmd[32];
+  uint32_t addr, len, ch;
+  size_t n = strcspn(line, " ");
+
+  memset(rec, 0, sizeof(*rec));
+  for (int op = 0; op < TRACE_READ; ++op) {
+    if (n == strlen(trace_op_names[op]) && strncmp(line, trace_op_names[op], n) == 0) {
+      rec->op = op;
+      return 1;
+    }
+  }
+
+  if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
+    return -1;
+  if (strcmp(cmd, "READ") == 0)
+    rec->op = TRACE_READ;
+  else if (strcmp(cmd, "WRITE") == 0)
+    rec->op = TRACE_WRITE;
+  else
+    return -1;
+  rec->addr = addr;
+  rec->len = len;
+  rec->fill = ch;
+  return 1;
+}
+
+int trace_print_record(FILE *out, const trace_record_t *rec) {
+  int rc;
+  if (rec->op >= TRACE_NUM_OPS)
+    return -1;
+  if (rec->op == TRACE_READ || rec->op == TRACE_WRITE)
+    rc = fprintf(out, "%s %u %u %u\n", trace_op_names[rec->op], rec->addr, rec->len, rec->fill);
+  else
+    rc = fprintf(out, "%s\n", trace_op_names[rec->op]);
+  return rc < 0 ? -1 : 1;
+}
+
+int trace_convert(const char *text_file, const char *binary_file) {
+  char line[256];
+  trace_header_t header;
+  trace_record_t rec;
+  int line_num = 0, rc = -1;
+
+  FILE *in = fopen(text_file, "r");
+  if (!in) {
+    warn("Cannot open workload file %s", text_file);
+    return -1;
+  }
+  FILE *out = fopen(binary_file, "w");
+  if (!out) {
+    warn("Cannot create trace file %s", binary_file);
+    fclose(in);
+    return -1;
+  }
+
+  /* The record count is patched in once every line has been parsed. */
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  if (fwrite(&header, sizeof(header), 1, out) != 1)
+    goto write_failed;
+
+  while (fgets(line, sizeof(line), in)) {
+    ++line_num;
+    line[strcspn(line, "\n")] = '\0';
+    if (trace_parse_line(line, &rec) != 1) {
+      warnx("Failed to parse command [%s] on line %d.", line, line_num);
+      goto out;
+    }
+    if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+      goto write_failed;
+    ++header.num_records;
+  }
+
+  if (ferror(in)) {
+    warn("Failed to read workload file %s", text_file);
+    goto out;
+  }
+  if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+    goto write_failed;
+  if (fclose(out) != 0) {
+    out = NULL;
+    goto write_failed;
+  }
+  out = NULL;
+  rc = line_num;
+  goto out;
+
+ write_failed:
+  warn("Failed to write trace file %s", binary_file);
+ out:
+  if (out)
+    fclose(out);
+  fclose(in);
+  return rc;
+}
+
+int trace_map(const char *file, trace_map_t *t) {
+  struct stat st;
+  const trace_header_t *header;
+
+  memset(t, 0, sizeof(*t));
+  int fd = open(file, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(trace_header_t)) {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  header = map;
+  if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+  if (header->num_records != (st.st_size - sizeof(*header)) / sizeof(trace_record_t)) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Replay walks the records front to back exactly once. */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  t->records = (const trace_record_t *)(header + 1);
+  t->num_records = header->num_records;
+  t->map = map;
+  t->map_len = st.st_size;
+  return 1;
+}
+
+void trace_unmap(trace_map_t *t) {
+  if (t->map)
+    munmap(t->map, t->map_len);
+  memset(t, 0, sizeof(*t));
+}
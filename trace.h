@@ -0,0 +1,66 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* Commands a workload trace can contain. */
+typedef enum {
+  TRACE_MOUNT,
+  TRACE_UNMOUNT,
+  TRACE_WRITE_PERMIT,
+  TRACE_WRITE_PERMIT_REVOKE,
+  TRACE_SIGNALL,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_NUM_OPS,
+} trace_op_t;
+
+/* One trace command. |addr|, |len| and |fill| are only meaningful for
+ * TRACE_READ and TRACE_WRITE; |fill| is the byte a write stores. */
+typedef struct {
+  uint8_t op;
+  uint8_t fill;
+  uint16_t len;
+  uint32_t addr;
+} trace_record_t;
+
+/* A binary trace is this header followed by |num_records| records, all in
+ * host byte order. */
+#define TRACE_MAGIC "MDTRACE1"
+
+typedef struct {
+  char magic[8];
+  uint64_t num_records;
+} trace_header_t;
+
+/* A binary trace mapped into memory by trace_map. */
+typedef struct {
+  const trace_record_t *records;
+  uint64_t num_records;
+  void *map;
+  size_t map_len;
+} trace_map_t;
+
+/* Parses one text trace line, without its newline, into |rec|. Returns 1 on
+ * success and -1 if the line is not a command. */
+int trace_parse_line(const char *line, trace_record_t *rec);
+
+/* Writes |rec| to |out| as one text trace line. Returns 1 on success and -1
+ * on failure. */
+int trace_print_record(FILE *out, const trace_record_t *rec);
+
+/* Converts the text trace |text_file| into the binary trace |binary_file|.
+ * Returns the number of records written, or -1 on failure with the reason
+ * printed to stderr. */
+int trace_convert(const char *text_file, const char *binary_file);
+
+/* Maps |file| if it is a binary trace. Returns 1 if it was mapped, 0 if the
+ * file is not a binary trace (for instance a text one) and -1 on failure. */
+int trace_map(const char *file, trace_map_t *t);
+
+/* Unmaps a trace mapped by trace_map. */
+void trace_unmap(trace_map_t *t);
+
+#endif
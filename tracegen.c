@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "util.h"
+#include "trace.h"
+
+#define TRACEGEN_ARGUMENTS "hn:s:d:z:S:w:l:x:b:g"
+#define USAGE                                               \
+  "USAGE: tracegen [-h] [-n ops] [-s seed] [-d dist] [-z theta] [-S streams] [-w percent] [-l sizes] [-x percent] [-b trace-file] [-g]\n" \
+  "\n"                                                      \
+  "where:\n"                                                \
+  "    -h - help mode (display this message)\n"             \
+  "    -n - number of reads and writes to generate (default 1000000)\n" \
+  "    -s - random seed; the same seed gives the same trace (default 1)\n" \
+  "    -d - address distribution: uniform (default), zipf or seq\n" \
+  "    -z - zipf skew, between 0 and 1 exclusive (default 0.99)\n" \
+  "    -S - number of interleaved sequential streams for seq (default 4)\n" \
+  "    -w - percentage of writes (default 50)\n"        \
+  "    -l - I/O size histogram as size:weight,... (default 256:1)\n" \
+  "    -x - percentage of I/Os placed across a disk boundary (default 0)\n" \
+  "    -b - write a binary trace to this file instead of text to stdout\n" \
+  "    -g - end the trace with SIGNALL\n"                 \
+  "\n"
+
+#define NUM_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define TOTAL_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+#define MAX_LEN 1024
+#define MAX_SIZES 16
+#define MAX_STREAMS 1024
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF, DIST_SEQ } dist_t;
+
+/* The I/O size histogram, as cumulative weights. */
+static uint32_t sizes[MAX_SIZES];
+static uint64_t size_weights[MAX_SIZES];
+static int num_sizes;
+
+/* Zipfian block ranks, after Gray et al., "Quickly generating billion-record
+ * synthetic databases". Rank r maps to block zipf_blocks[r], so the hot set
+ * is scattered over the disks instead of packed at address 0. */
+static double zipf_theta, zipf_zetan, zipf_alpha, zipf_eta;
+static uint32_t zipf_blocks[NUM_BLOCKS];
+
+/* Next address of each sequential stream. */
+static uint32_t streams[MAX_STREAMS];
+static int num_streams = 4;
+
+/* Uniform in [0, n). */
+static uint32_t rand_below(uint32_t n) {
+  return get_rand(0, n - 1);
+}
+
+static int parse_sizes(char *spec) {
+  uint64_t total = 0;
+  num_sizes = 0;
+  for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+    unsigned size, weight = 1;
+    if (num_sizes == MAX_SIZES || sscanf(tok, "%u:%u", &size, &weight) < 1 ||
+        size == 0 || size > MAX_LEN || weight == 0)
+      return -1;
+    total += weight;
+    sizes[num_sizes] = size;
+    size_weights[num_sizes++] = total;
+  }
+  return num_sizes ? 1 : -1;
+}
+
+static uint32_t pick_size(void) {
+  uint64_t w = rand_u64() % size_weights[num_sizes - 1];
+  int i = 0;
+  while (size_weights[i] <= w)
+    ++i;
+  return sizes[i];
+}
+
+static void zipf_init(double theta) {
+  double zeta2 = 1 + pow(0.5, theta);
+
+  zipf_theta = theta;
+  zipf_zetan = 0;
+  for (int i = 1; i <= NUM_BLOCKS; ++i)
+    zipf_zetan += 1 / pow(i, theta);
+  zipf_alpha = 1 / (1 - theta);
+  zipf_eta = (1 - pow(2.0 / NUM_BLOCKS, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+
+  for (int i = 0; i < NUM_BLOCKS; ++i)
+    zipf_blocks[i] = i;
+  for (int i = NUM_BLOCKS - 1; i > 0; --i) {
+    uint32_t j = rand_below(i + 1), t = zipf_blocks[i];
+    zipf_blocks[i] = zipf_blocks[j];
+    zipf_blocks[j] = t;
+  }
+}
+
+static uint32_t zipf_block(void) {
+  double u = rand_double(), uz = u * zipf_zetan;
+  uint32_t rank;
+
+  if (uz < 1)
+    rank = 0;
+  else if (uz < 1 + pow(0.5, zipf_theta))
+    rank = 1;
+  else
+    rank = (uint32_t)(NUM_BLOCKS * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha));
+  if (rank >= NUM_BLOCKS)
+    rank = NUM_BLOCKS - 1;
+  return zipf_blocks[rank];
+}
+
+/* Picks where an I/O of |len| bytes starts. Every I/O fits on the device. */
+static uint32_t pick_addr(dist_t dist, uint32_t len, int cross_pct) {
+  uint32_t addr;
+
+  if (len > 1 && cross_pct && rand_below(100) < (uint32_t)cross_pct) {
+    uint32_t boundary = (1 + rand_below(JBOD_NUM_DISKS - 1)) * JBOD_DISK_SIZE;
+    return boundary - 1 - rand_below(len - 1);
+  }
+
+  switch (dist) {
+    case DIST_ZIPF:
+      addr = zipf_block() * JBOD_BLOCK_SIZE + rand_below(JBOD_BLOCK_SIZE);
+      break;
+    case DIST_SEQ: {
+      uint32_t *next = &streams[rand_below(num_streams)];
+      if (*next + len > TOTAL_SIZE)
+        *next = 0;
+      addr = *next;
+      *next += len;
+      return addr;
+    }
+    default:
+      addr = rand_below(TOTAL_SIZE);
+      break;
+  }
+  return addr + len > TOTAL_SIZE ? TOTAL_SIZE - len : addr;
+}
+
+static void emit(FILE *out, bool binary, const trace_record_t *rec) {
+  if (binary ? fwrite(rec, sizeof(*rec), 1, out) != 1 : trace_print_record(out, rec) != 1)
+    err(1, "Failed to write the trace");
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+  uint64_t num_ops = 1000000, seed = 1;
+  dist_t dist = DIST_UNIFORM;
+  double theta = 0.99;
+  int write_pct = 50, cross_pct = 0;
+  char default_sizes[] = "256:1";
+  char *size_spec = default_sizes;
+  char *binary_file = NULL;
+  bool sign = false;
+
+  while ((ch = getopt(argc, argv, TRACEGEN_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'n':
+        num_ops = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'd':
+        if (strcmp(optarg, "uniform") == 0)
+          dist = DIST_UNIFORM;
+        else if (strcmp(optarg, "zipf") == 0)
+          dist = DIST_ZIPF;
+        else if (strcmp(optarg, "seq") == 0)
+          dist = DIST_SEQ;
+        else
+          errx(1, "Unknown distribution (%s), aborting.", optarg);
+        break;
+      case 'z':
+        theta = atof(optarg);
+        if (theta <= 0 || theta >= 1)
+          errx(1, "Zipf skew must be between 0 and 1 exclusive (%s), aborting.", optarg);
+        break;
+      case 'S':
+        num_streams = atoi(optarg);
+        if (num_streams < 1 || num_streams > MAX_STREAMS)
+          errx(1, "Invalid number of streams (%s), aborting.", optarg);
+        break;
+      case 'w':
+        write_pct = atoi(optarg);
+        if (write_pct < 0 || write_pct > 100)
+          errx(1, "Invalid write percentage (%s), aborting.", optarg);
+        break;
+      case 'l':
+        size_spec = optarg;
+        break;
+      case 'x':
+        cross_pct = atoi(optarg);
+        if (cross_pct < 0 || cross_pct > 100)
+          errx(1, "Invalid cross-disk percentage (%s), aborting.", optarg);
+        break;
+      case 'b':
+        binary_file = optarg;
+        break;
+      case 'g':
+        sign = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+  if (parse_sizes(size_spec) != 1)
+    errx(1, "Invalid size histogram (%s), aborting.", size_spec);
+
+  rand_seed(seed);
+  if (dist == DIST_ZIPF)
+    zipf_init(theta);
+  for (int i = 0; i < num_streams; ++i)
+    streams[i] = rand_below(NUM_BLOCKS) * JBOD_BLOCK_SIZE;
+
+  FILE *out = stdout;
+  if (binary_file) {
+    trace_header_t header = { .num_records = num_ops + 3 + sign };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    out = fopen(binary_file, "w");
+    if (!out || fwrite(&header, sizeof(header), 1, out) != 1)
+      err(1, "Cannot create trace file %s", binary_file);
+  }
+
+  trace_record_t rec = { .op = TRACE_MOUNT };
+  emit(out, binary_file, &rec);
+  rec.op = TRACE_WRITE_PERMIT;
+  emit(out, binary_file, &rec);
+  for (uint64_t i = 0; i < num_ops; ++i) {
+    bool write = rand_below(100) < (uint32_t)write_pct;
+    rec.op = write ? TRACE_WRITE : TRACE_READ;
+    rec.len = pick_size();
+    rec.addr = pick_addr(dist, rec.len, cross_pct);
+    rec.fill = write ? rand_below(256) : 0;
+    emit(out, binary_file, &rec);
+  }
+  rec = (trace_record_t){ .op = TRACE_SIGNALL };
+  if (sign)
+    emit(out, binary_file, &rec);
+  rec.op = TRACE_UNMOUNT;
+  emit(out, binary_file, &rec);
+
+  if (fclose(out) != 0)
+    err(1, "Failed to write the trace");
+  return 0;
+}
@@ -1,57 +1,281 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 
 #include "util.h"
 
-static int debug_log_enabled = 0;
+static atomic_int debug_log_enabled = 0;
 static int debug_log_fd = 2;  /* by default write log to stderr */
+static int crypto_rand_enabled = 0;
+
+/* The asynchronous sink: a bounded ring of fixed-size message slots after
+ * Vyukov's MPMC queue, used with many producers and the one drain thread.
+ * A slot's sequence number says whose turn it is: |pos| when free for the
+ * producer claiming position |pos|, |pos| + 1 once that message is in it.
+ * Producers only wait when the ring is full, and such stalls are counted,
+ * so that no message is ever lost. The drain thread copies messages into a
+ * buffer that goes out in one write per LOG_BATCH_SIZE bytes or whenever the
+ * ring runs dry. */
+#define LOG_RING_SLOTS 16384
+#define LOG_SLOT_SIZE 248
+#define LOG_BATCH_SIZE 65536
+#define LOG_IDLE_NS 100000
+
+typedef struct {
+  atomic_size_t seq;
+  char text[LOG_SLOT_SIZE];
+} log_slot_t;
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static atomic_size_t log_head;     /* next position a producer claims */
+static atomic_size_t log_drained;  /* positions the drain thread has written */
+static atomic_ullong log_stalls;
+static atomic_bool log_async = false;
+static atomic_bool log_stopping = false;
+static pthread_t log_thread;
 
 void enable_debug_log(void) {
   debug_log_enabled = 1;
 }
 
+void disable_debug_log(void) {
+  debug_log_enabled = 0;
+}
+
 void set_debug_logfile(const char *filename) {
-  debug_log_fd = open(filename, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+  debug_log_fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
   if (debug_log_fd == -1)
     err(1, "failed to open log file %s", filename);
 }
 
-void debug_log(const char *fmt, ...) {
-  if (!debug_log_enabled)
+static void log_write(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(debug_log_fd, buf, len);
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+static void *log_drain(void *arg) {
+  static char batch[LOG_BATCH_SIZE];
+  size_t tail = 0, used = 0;
+  (void)arg;
+
+  for (;;) {
+    log_slot_t *slot = &log_ring[tail % LOG_RING_SLOTS];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) == tail + 1) {
+      size_t len = strnlen(slot->text, LOG_SLOT_SIZE);
+      if (used + len > LOG_BATCH_SIZE) {
+        log_write(batch, used);
+        used = 0;
+      }
+      memcpy(batch + used, slot->text, len);
+      used += len;
+      atomic_store_explicit(&slot->seq, tail + LOG_RING_SLOTS, memory_order_release);
+      ++tail;
+      continue;
+    }
+
+    /* The ring is dry: write what has been gathered, then wait for more. */
+    log_write(batch, used);
+    used = 0;
+    atomic_store(&log_drained, tail);
+    if (atomic_load(&log_stopping) && atomic_load(&log_head) == tail)
+      return NULL;
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    nanosleep(&idle, NULL);
+  }
+}
+
+static void log_stop(void) {
+  if (!atomic_exchange(&log_async, false))
+    return;
+  atomic_store(&log_stopping, true);
+  pthread_join(log_thread, NULL);
+  atomic_store(&log_stopping, false);
+}
+
+void enable_async_debug_log(void) {
+  static bool registered = false;
+
+  if (atomic_load(&log_async))
+    return;
+  for (size_t i = 0; i < LOG_RING_SLOTS; ++i)
+    atomic_store(&log_ring[i].seq, i);
+  atomic_store(&log_head, 0);
+  atomic_store(&log_drained, 0);
+  if (pthread_create(&log_thread, NULL, log_drain, NULL) != 0)
+    return;
+  atomic_store(&log_async, true);
+  /* Messages still in the ring get written out when the program exits. */
+  if (!registered && atexit(log_stop) == 0)
+    registered = true;
+}
+
+void disable_async_debug_log(void) {
+  log_stop();
+}
+
+void flush_debug_log(void) {
+  size_t head = atomic_load(&log_head);
+  struct timespec idle = { 0, LOG_IDLE_NS };
+
+  while (atomic_load(&log_async) && atomic_load(&log_drained) < head)
+    nanosleep(&idle, NULL);
+}
+
+uint64_t debug_log_stalls(void) {
+  return atomic_load(&log_stalls);
+}
+
+static void log_message(const char *fmt, va_list args) {
+  if (!atomic_load_explicit(&debug_log_enabled, memory_order_relaxed))
     return;
 
+  if (!atomic_load_explicit(&log_async, memory_order_acquire)) {
+    /* Formatted with its newline, so that it takes one write. */
+    char text[LOG_SLOT_SIZE];
+    int n = vsnprintf(text, sizeof(text) - 1, fmt, args);
+    if (n < 0)
+      return;
+    if (n > (int)sizeof(text) - 2)
+      n = sizeof(text) - 2;
+    text[n++] = '\n';
+    log_write(text, n);
+    return;
+  }
+
+  size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+  log_slot_t *slot;
+  for (;;) {
+    slot = &log_ring[pos % LOG_RING_SLOTS];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      /* Full: let the drain thread catch up rather than lose the message. */
+      atomic_fetch_add_explicit(&log_stalls, 1, memory_order_relaxed);
+      sched_yield();
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    } else {
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+  }
+
+  /* Messages longer than a slot are cut short, but keep their newline. */
+  int n = vsnprintf(slot->text, LOG_SLOT_SIZE - 1, fmt, args);
+  if (n < 0)
+    n = 0;
+  if (n > LOG_SLOT_SIZE - 2)
+    n = LOG_SLOT_SIZE - 2;
+  slot->text[n++] = '\n';
+  if (n < LOG_SLOT_SIZE)
+    slot->text[n] = '\0';
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+void debug_log(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  vdprintf(debug_log_fd, fmt, args);
+  log_message(fmt, args);
   va_end(args);
-  dprintf(debug_log_fd, "\n");
+}
+
+void format_sig(const uint8_t *digest, char *sig) {
+  for (int i = 0; i < 15; ++i) {
+    char *p = sig + i * 5;
+    sprintf(p, "0x%02x ", digest[i]);
+  }
 }
 
 const char *sha1_sig(uint8_t *buf, uint32_t size) {
-  static char sig[80];
+  /* One buffer per thread, so that threads can sign blocks concurrently. */
+  static _Thread_local char sig[80];
   uint8_t obuf[20];
 
   SHA1(buf, size, obuf);
-  for (int i = 0; i < 15; ++i) {
-    char *p = (char *)sig + i * 5;
-    sprintf(p, "0x%02x ", obuf[i]);
-  }
+  format_sig(obuf, sig);
   return sig;
 }
 
+/* xoshiro256** state, seeded through splitmix64 as its authors recommend so
+ * that any seed, including 0, gives a well-mixed starting state. */
+static uint64_t rand_state[4] = {
+  0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0x2545f4914f6cdd1dull,
+};
+
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+void rand_seed(uint64_t seed) {
+  for (int i = 0; i < 4; ++i)
+    rand_state[i] = splitmix64(&seed);
+}
+
+uint64_t rand_u64(void) {
+  uint64_t *s = rand_state;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+double rand_double(void) {
+  return (rand_u64() >> 11) * 0x1.0p-53;
+}
+
+void enable_crypto_rand(void) {
+  crypto_rand_enabled = 1;
+}
+
 uint32_t get_rand(uint32_t min, uint32_t max) {
-  uint32_t v;
-  int rc = RAND_bytes((uint8_t *)&v, sizeof(v));
-  assert(rc);
-
-  v = (uint32_t)(v/(UINT32_MAX/(max - min + 1))) + min;
-  if (v == max+1)
-    v = max;
-  return v;
+  assert(min <= max);
+  uint64_t range = (uint64_t)max - min + 1;
+  uint64_t x, limit = (1ull << 32) - (1ull << 32) % range;
+
+  /* Draws past the last whole multiple of the range are redrawn, so that the
+   * remainder is unbiased. */
+  do {
+    if (crypto_rand_enabled) {
+      uint32_t v;
+      int rc = RAND_bytes((uint8_t *)&v, sizeof(v));
+      assert(rc == 1);
+      x = v;
+    } else {
+      x = rand_u64() >> 32;
+    }
+  } while (x >= limit);
+  return min + (uint32_t)(x % range);
 }
@@ -3,11 +3,70 @@
 
 #include <stdint.h>
 
+/* Log levels. Messages logged through the log_* macros at a level above
+ * LOG_LEVEL are compiled out, arguments and all; the default keeps errors and
+ * warnings.
+ * Build with -DLOG_LEVEL=LOG_LEVEL_TRACE to keep everything. */
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_WARN
+#endif
+
+#define LOG_AT(level, ...)            \
+  do {                                \
+    if ((level) <= LOG_LEVEL)         \
+      debug_log(__VA_ARGS__);         \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/* Logging is off until enable_debug_log is called; after that, every message
+ * that was compiled in is written with a newline to the log file (stderr by
+ * default). */
 void enable_debug_log(void);
+void disable_debug_log(void);
 void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
+/* Hand messages to a background thread instead of writing each one: logging
+ * then only formats into a lock-free ring, and the thread writes the ring out
+ * in large batches. A message that finds the ring full waits for room, which
+ * is counted as a stall. Whatever is left is written out at exit. Switching
+ * must not race with logging. */
+void enable_async_debug_log(void);
+void disable_async_debug_log(void);
+/* Waits until every message logged before the call has been written. */
+void flush_debug_log(void);
+uint64_t debug_log_stalls(void);
+
+/* Returns the printable form of the SHA-1 of |buf| in a buffer of the calling
+ * thread's, valid until its next call. */
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+/* Writes the printable form of a 20-byte |digest| to |sig|, which has room
+ * for 80 characters. */
+void format_sig(const uint8_t *digest, char *sig);
+/* Returns a uniform number in [min, max]. It draws from the generator below
+ * unless enable_crypto_rand has been called, in which case every number comes
+ * from OpenSSL's RAND_bytes: slow, and not reproducible, but unpredictable. */
 uint32_t get_rand(uint32_t min, uint32_t max);
+void enable_crypto_rand(void);
+
+/* A fast xoshiro256** generator for workloads that need many reproducible
+ * numbers. It is not cryptographic and not thread-safe. rand_seed restarts
+ * the sequence; the same seed always gives the same numbers. */
+void rand_seed(uint64_t seed);
+uint64_t rand_u64(void);
+/* Uniform in [0, 1). */
+double rand_double(void);
 
 #endif